@@ -50,6 +50,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#ifdef BENCHMARK
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -62,6 +70,13 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/*  Benchmark mode replays a trace the way the competition does (no
+ *  memory checks) and additionally times every call into the allocator.
+ */
+#ifdef BENCHMARK
+#define COMPETITION
+#endif
+
 enum REQ_STATE
   {
     FREE,
@@ -76,19 +91,81 @@ typedef struct mem
   enum REQ_STATE state;
 } mem_t;
 
+#ifdef BENCHMARK
+// every sample is kept, for the percentiles
+typedef struct
+{
+  int count;
+  long long total;
+  long long max;
+  int capacity;
+  long long* samples;
+} timing_t;
+
+// a trace parsed for threaded replays; size is -1 for a free
+typedef struct
+{
+  int id;
+  int size;
+} op_t;
+
+typedef struct
+{
+  int n_req;
+  int n_ops;
+  op_t* ops;
+} replay_t;
+
+/*  Threaded replays hold a lock around the allocator, unless the
+ *  magazine layer makes it safe to call from many threads.
+ */
+#ifdef KMA_MAGAZINE
+#define LOCKALLOC()
+#define UNLOCKALLOC()
+#else
+#define LOCKALLOC() pthread_mutex_lock(&allocLock)
+#define UNLOCKALLOC() pthread_mutex_unlock(&allocLock)
+#endif
+#endif
+
 /************Global Variables*********************************************/
 
 static int val = 0;
 
+#ifdef BENCHMARK
+static long long firstAlloc = -1;
+static timing_t idleAllocs = { 0, 0, 0, 0, NULL };
+static timing_t allocs = { 0, 0, 0, 0, NULL };
+static timing_t frees = { 0, 0, 0, 0, NULL };
+#ifndef KMA_MAGAZINE
+static pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+#else
+// magazine counters as the threaded replay left them
+static kma_mag_stat_t threadedMags = { 0, 0, 0, 0 };
+#endif
+#endif
+
 /************Function Prototypes******************************************/
 void allocate();
 void deallocate();
 void fill(char*, int);
 void check(char*, char*, int);
+void checkZero(char*, int);
 void usage();
 void error(char*, char*);
 void pass();
 void fail();
+#ifdef BENCHMARK
+long long now();
+int openTlbCounter();
+long residentKb();
+void record(timing_t*, long long);
+void report(char*, timing_t*);
+long long percentile(timing_t*, double);
+int compareSamples(const void*, const void*);
+void threadedReplay(char*, int);
+void* replay(void*);
+#endif
 
 /************External Declaration*****************************************/
 
@@ -108,7 +185,11 @@ main(int argc, char* argv[])
   
   name = argv[0];
   
-#ifdef COMPETITION
+#ifdef BENCHMARK
+  printf("%s: Running in benchmark mode\n", name);
+#endif
+
+#if defined(COMPETITION) && !defined(BENCHMARK)
   printf("%s: Running in competition mode\n", name);
 #endif
 
@@ -123,6 +204,12 @@ main(int argc, char* argv[])
   double ratioSum = 0.0;
   int ratioCount = 0;
 #endif
+
+#ifdef BENCHMARK
+  // dTLB misses of the whole replay, where the PMU is available
+  int tlbCounter = openTlbCounter();
+  long long replayStart = now();
+#endif
   
 #ifndef COMPETITION
   FILE* allocTrace = fopen("kma_output.dat", "w");
@@ -138,6 +225,14 @@ main(int argc, char* argv[])
       usage();
     }
   
+#ifdef BENCHMARK
+  // with KMA_THREADS=n the trace is first replayed on n threads at once
+  if (getenv("KMA_THREADS") != NULL && atoi(getenv("KMA_THREADS")) > 0)
+    {
+      threadedReplay(argv[1], atoi(getenv("KMA_THREADS")));
+    }
+#endif
+  
   FILE* f_test = fopen(argv[1], "r");
   if (f_test == NULL)
     {
@@ -231,6 +326,40 @@ main(int argc, char* argv[])
 #ifdef COMPETITION
   printf("Competition average ratio: %f\n", ratioSum / ratioCount);
 #endif
+
+#ifdef BENCHMARK
+  long long tlbMisses;
+  printf("Replay time: %lld us\n", (now() - replayStart) / 1000);
+  if (tlbCounter >= 0 && read(tlbCounter, &tlbMisses, sizeof(tlbMisses)) == sizeof(tlbMisses))
+    {
+      printf("dTLB load misses: %lld\n", tlbMisses);
+    }
+  else
+    {
+      printf("dTLB load misses: n/a\n");
+    }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("Resident set after replay: %ld KB (peak %ld KB)\n",
+	 residentKb(), usage.ru_maxrss);
+  printf("Time to first allocation: %lld ns\n", firstAlloc);
+  report("kma_malloc on idle pool", &idleAllocs);
+  report("kma_malloc", &allocs);
+  report("kma_free", &frees);
+  printf("Retained pages reclaimed/purged/left: %d/%d/%d\n",
+	 stat->num_reclaimed, stat->num_purged, stat->num_retained);
+  printf("Empty regions revived/released: %d/%d\n",
+	 stat->num_regions_revived, stat->num_regions_released);
+#ifdef KMA_MAGAZINE
+  // only what this replay added to the counters
+  kma_mag_stat_t* mags = mag_stats();
+  printf("Magazine backend calls/exchanges/contended: %d/%d/%d (of %d calls), rounds up to %d\n",
+	 mags->num_backend - threadedMags.num_backend,
+	 mags->num_exchanges - threadedMags.num_exchanges,
+	 mags->num_contended - threadedMags.num_contended,
+	 allocs.count + frees.count, mags->max_rounds);
+#endif
+#endif
   
   pass();
   return 0;
@@ -270,18 +399,38 @@ allocate(mem_t* requests, int req_id, int req_size)
   assert(new->state == FREE);
   
   new->size = req_size;
+#ifdef BENCHMARK
+  // an allocation while no page is in use pays for (re)starting the pool
+  bool idle = (page_stats()->num_in_use == 0);
+  long long start = now();
+#endif
+#ifndef COMPETITION
+  // every other request is served zeroed, to check kma_calloc() too
+  if (req_id % 2 == 1)
+    {
+      new->ptr = kma_calloc(1, new->size);
+    }
+  else
+#endif
   new->ptr = kma_malloc(new->size);
-  
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+#ifdef BENCHMARK
+  long long elapsed = now() - start;
+  if (firstAlloc < 0)
     {
-      error("got NULL from kma_malloc for alloc'able request", "");
+      firstAlloc = elapsed;
     }
+  if (idle)
+    {
+      record(&idleAllocs, elapsed);
+    }
+  record(&allocs, elapsed);
+#endif
   
+  // Requests larger than a page are served from contiguous pages,
+  // so every request must succeed
   if (new->ptr == NULL)
     {
-      return;
+      error("got NULL from kma_malloc for alloc'able request", "");
     }
 
   currentAllocBytes += req_size;
@@ -293,6 +442,11 @@ allocate(mem_t* requests, int req_id, int req_size)
   new->value = malloc(new->size);
   assert(new->value != NULL);
   
+  if (req_id % 2 == 1)
+    {
+      checkZero((char*)new->ptr, new->size);
+    }
+  
   // initialize memory
   fill((char*)new->ptr, new->size);
   
@@ -324,7 +478,13 @@ deallocate(mem_t* requests, int req_id)
   free(cur->value);
 #endif
 
+#ifdef BENCHMARK
+  long long start = now();
+#endif
   kma_free(cur->ptr, cur->size);
+#ifdef BENCHMARK
+  record(&frees, now() - start);
+#endif
 
   currentAllocBytes -= cur->size;
   
@@ -357,3 +517,209 @@ check(char* lhs, char* rhs, int size)
 	}
     }
 }
+
+void
+checkZero(char* ptr, int size)
+{
+  int i;
+  
+  for (i = 0; i < size; i++)
+    {
+      if (ptr[i] != 0)
+	{
+	  fprintf(stderr, "memory not zeroed at position %d (%3d)\n", i, ptr[i]);
+	  anyMismatches = 1;
+	  return;
+	}
+    }
+}
+
+#ifdef BENCHMARK
+long long
+now()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int
+openTlbCounter()
+{
+  struct perf_event_attr attr;
+  
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long
+residentKb()
+{
+  FILE* statm = fopen("/proc/self/statm", "r");
+  long size, resident = 0;
+  
+  if (statm != NULL)
+    {
+      if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+	{
+	  resident = 0;
+	}
+      fclose(statm);
+    }
+  
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void
+record(timing_t* timing, long long elapsed)
+{
+  if (timing->count == timing->capacity)
+    {
+      timing->capacity = timing->capacity ? 2 * timing->capacity : 1024;
+      timing->samples = realloc(timing->samples, timing->capacity * sizeof(long long));
+      assert(timing->samples != NULL);
+    }
+  timing->samples[timing->count] = elapsed;
+  timing->count++;
+  timing->total += elapsed;
+  if (elapsed > timing->max)
+    {
+      timing->max = elapsed;
+    }
+}
+
+void
+report(char* what, timing_t* timing)
+{
+  qsort(timing->samples, timing->count, sizeof(long long), compareSamples);
+  
+  printf("%s: %d calls, avg %.1f ns, p50 %lld ns, p99 %lld ns, p99.9 %lld ns, max %lld ns\n",
+	 what, timing->count,
+	 timing->count ? ((double) timing->total) / timing->count : 0.0,
+	 percentile(timing, 0.5), percentile(timing, 0.99),
+	 percentile(timing, 0.999), timing->max);
+}
+
+long long
+percentile(timing_t* timing, double fraction)
+{
+  // the samples are sorted by report()
+  if (timing->count == 0)
+    {
+      return 0;
+    }
+  
+  return timing->samples[(int) (fraction * (timing->count - 1))];
+}
+
+int
+compareSamples(const void* lhs, const void* rhs)
+{
+  long long a = *(const long long*) lhs;
+  long long b = *(const long long*) rhs;
+  
+  return (a > b) - (a < b);
+}
+
+void
+threadedReplay(char* trace, int n_threads)
+{
+  replay_t run = { 0, 0, NULL };
+  pthread_t* threads = malloc(n_threads * sizeof(pthread_t));
+  char command[16];
+  int i, capacity = 1024;
+  
+  // parse the whole trace first, so the threads only call the allocator
+  FILE* f = fopen(trace, "r");
+  if (f == NULL || fscanf(f, "%d\n", &run.n_req) != 1)
+    {
+      error("unable to read input test file", trace);
+    }
+  run.ops = malloc(capacity * sizeof(op_t));
+  while (fscanf(f, "%10s", command) == 1)
+    {
+      op_t* op;
+      
+      if (run.n_ops == capacity)
+	{
+	  capacity *= 2;
+	  run.ops = realloc(run.ops, capacity * sizeof(op_t));
+	}
+      op = &run.ops[run.n_ops++];
+      op->size = -1;
+      if ((strcmp(command, "REQUEST") == 0 && fscanf(f, "%d %d", &op->id, &op->size) != 2)
+	  || (strcmp(command, "FREE") == 0 && fscanf(f, "%d", &op->id) != 1))
+	{
+	  error("bad line in input test file", command);
+	}
+    }
+  fclose(f);
+  
+  long long start = now();
+  for (i = 0; i < n_threads; i++)
+    {
+      pthread_create(&threads[i], NULL, replay, &run);
+    }
+  for (i = 0; i < n_threads; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+  long long elapsed = now() - start;
+  
+  printf("Threaded replay: %d threads, %lld us, %.1f ns per call\n", n_threads,
+	 elapsed / 1000, ((double) elapsed) / ((long long) run.n_ops * n_threads));
+#ifdef KMA_MAGAZINE
+  threadedMags = *mag_stats();
+  printf("Threaded magazine backend calls/exchanges/contended: %d/%d/%d (of %d calls), rounds up to %d\n",
+	 threadedMags.num_backend, threadedMags.num_exchanges,
+	 threadedMags.num_contended, run.n_ops * n_threads,
+	 threadedMags.max_rounds);
+#endif
+  
+  free(run.ops);
+  free(threads);
+}
+
+void*
+replay(void* arg)
+{
+  replay_t* run = (replay_t*) arg;
+  void** ptrs = calloc(run->n_req, sizeof(void*));
+  int* sizes = calloc(run->n_req, sizeof(int));
+  int i;
+  
+  // every thread replays the whole trace on requests of its own
+  for (i = 0; i < run->n_ops; i++)
+    {
+      op_t* op = &run->ops[i];
+      
+      if (op->size >= 0)
+	{
+	  LOCKALLOC();
+	  ptrs[op->id] = kma_malloc(op->size);
+	  UNLOCKALLOC();
+	  sizes[op->id] = op->size;
+	  *(char*) ptrs[op->id] = 0;
+	}
+      else
+	{
+	  LOCKALLOC();
+	  kma_free(ptrs[op->id], sizes[op->id]);
+	  UNLOCKALLOC();
+	}
+    }
+  
+  free(ptrs);
+  free(sizes);
+  return NULL;
+}
+#endif
@@ -0,0 +1,437 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on a bitmap of
+ *             16-byte granules per page
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.2  2009/10/31 21:28:52  jot836
+ *    This is the current version of KMA project 3.
+ *    It includes:
+ *    - the most up-to-date handout (F'09)
+ *    - updated skeleton including
+ *        file-driven test harness,
+ *        trace generator script,
+ *        support for evaluating efficiency of algorithm (wasted memory),
+ *        gnuplot support for plotting allocation and waste,
+ *        set of traces for all students to use (including a makefile and README of the settings),
+ *    - different version of the testsuite for use on the submission site, including:
+ *        scoreboard Python scripts, which posts the top 5 scores on the course webpage
+ *
+ *    Revision 1.1  2005/10/24 16:07:09  sbirrer
+ *    - skeleton
+ *
+ *    Revision 1.2  2004/11/05 15:45:56  sbirrer
+ *    - added size as a parameter to kma_free
+ *
+ *    Revision 1.1  2004/11/03 23:04:03  sbirrer
+ *    - initial version for the kernel memory allocator project
+ *
+ ***************************************************************************/
+#ifdef KMA_BMAP
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*  Every page is cut into GRANULE-byte granules, and a bitmap at the
+ *  start of the page marks the ones in use (the bitmap's own granules
+ *  are always in use). A space is a run of free granules: kma_malloc
+ *  looks for the first run long enough, skipping the bitmap words that
+ *  are all in use, and kma_free clears the bits of the run again, a
+ *  word at a time. Free neighbours need no merging; their bits are
+ *  simply next to each other.
+ *
+ *  The count of free granules is kept in the page's nfree. Pages with
+ *  free granules are on a list (through the prev and next fields of
+ *  their kma_page_t); a page with none left leaves it, and a page with
+ *  all of them free goes back to the page layer, which retains it for
+ *  a while. Spaces larger than a page can hold get pages of their own.
+ *
+ *  The page's sclass bounds its longest free run from above: a search
+ *  that fails on a page learns the longest run, an allocation lowers
+ *  the bound to what is left, and a free raises it to all that is free.
+ *  Pages are kept in buckets by the power of two below their bound, and
+ *  a bitmap tells which buckets have pages; a search starts at the
+ *  bucket of its size and never looks at a page that cannot fit.
+ *
+ *  Finding the bitmap words that are all in use is a vector compare
+ *  with AVX2 or SSE when the compiler targets them, and a plain loop
+ *  otherwise.
+ */
+#define GRANULESHIFT 4
+#define GRANULE (1 << GRANULESHIFT)
+#define GRANULES (PAGESIZE / GRANULE)
+
+#define WORDBITS (8 * sizeof(unsigned long))
+// 8 words, 64 bytes, with 8 KB pages
+#define WORDS (GRANULES / WORDBITS)
+// granules taken by the bitmap itself
+#define MAPGRANULES ((WORDS * sizeof(unsigned long) + GRANULE - 1) / GRANULE)
+#define MAXGRANULES (GRANULES - MAPGRANULES)
+
+#define BITMAP(page) ((unsigned long*) (page)->ptr)
+
+// a bucket for every power of two up to MAXGRANULES
+#define BUCKETS 10
+#define BUCKET(bound) (31 - __builtin_clz(bound))
+
+/************Global Variables*********************************************/
+// pages with free granules, by the bound of their longest run
+static kma_page_t* g_buckets[BUCKETS];
+static unsigned int g_nonempty = 0;
+
+/************Function Prototypes******************************************/
+int full_words(unsigned long* bits);
+int find_run(unsigned long* bits, int n, int* longest);
+void set_run(unsigned long* bits, int start, int n, int used);
+kma_page_t* new_page();
+void set_bound(kma_page_t* page, int bound);
+void link_page(kma_page_t* page);
+void unlink_page(kma_page_t* page);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  kma_page_t* page = NULL;
+  unsigned int buckets;
+  int n, longest, start = -1;
+  
+  if (size > MAXGRANULES * GRANULE)
+    {
+      return get_pages((size + PAGESIZE - 1) / PAGESIZE)->ptr;
+    }
+  
+  n = size == 0 ? 1 : (size + GRANULE - 1) >> GRANULESHIFT;
+  
+  // only the bucket of n itself can hold pages too short for it
+  buckets = g_nonempty & (~0U << BUCKET(n));
+  while (start < 0 && buckets != 0)
+    {
+      int b = __builtin_ctz(buckets);
+      kma_page_t* next;
+  
+      buckets &= buckets - 1;
+      for (page = g_buckets[b]; page != NULL; page = next)
+	{
+	  next = page->next;
+	  if (page->sclass < n)
+	    {
+	      continue;
+	    }
+	  start = find_run(BITMAP(page), n, &longest);
+	  if (start >= 0)
+	    {
+	      break;
+	    }
+	  set_bound(page, longest);
+	}
+    }
+  if (start < 0)
+    {
+      page = new_page();
+      start = MAPGRANULES;
+    }
+  
+  set_run(BITMAP(page), start, n, 1);
+  page->nfree -= n;
+  set_bound(page, page->sclass < page->nfree ? page->sclass : page->nfree);
+  
+  return (char*) page->ptr + (start << GRANULESHIFT);
+}
+
+void*
+kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  void* ptr;
+  
+  if (size != 0 && nmemb > INT_MAX / size)
+    {
+      return NULL;
+    }
+  
+  // a large space gets pages that are zero already
+  if (nmemb * size > MAXGRANULES * GRANULE)
+    {
+      return get_zeroed_pages((nmemb * size + PAGESIZE - 1) / PAGESIZE)->ptr;
+    }
+  
+  ptr = kma_malloc(nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  kma_page_t* page = page_of(ptr);
+  int n;
+  
+  if (size > MAXGRANULES * GRANULE)
+    {
+      free_pages(page);
+      return;
+    }
+  
+  n = size == 0 ? 1 : (size + GRANULE - 1) >> GRANULESHIFT;
+  
+  set_run(BITMAP(page), ((char*) ptr - (char*) page->ptr) >> GRANULESHIFT,
+	  n, 0);
+  page->nfree += n;
+  
+  if (page->nfree == MAXGRANULES)
+    {
+      set_bound(page, 0);
+      retain_pages(&page, 1);
+    }
+  else
+    {
+      // the freed run can only join the runs on either side of it
+      int bound = 2 * page->sclass + n;
+  
+      set_bound(page, bound < page->nfree ? bound : page->nfree);
+    }
+}
+
+int
+full_words(unsigned long* bits)
+{
+  // bit i is set when every granule of word i is in use
+#if defined(__AVX2__)
+  __m256i ones = _mm256_set1_epi64x(-1);
+  int mask = 0;
+  int i;
+  
+  // four words per load, so the loads end with the bitmap
+  for (i = 0; i < WORDS / 4; i++)
+    {
+      __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i*) bits + i), ones);
+  
+      mask |= _mm256_movemask_pd(_mm256_castsi256_pd(eq)) << (4 * i);
+    }
+  
+  return mask;
+#elif defined(__SSE4_1__)
+  __m128i ones = _mm_set1_epi64x(-1);
+  int mask = 0;
+  int i;
+  
+  for (i = 0; i < WORDS / 2; i++)
+    {
+      __m128i eq = _mm_cmpeq_epi64(_mm_loadu_si128((__m128i*) bits + i), ones);
+  
+      mask |= _mm_movemask_pd(_mm_castsi128_pd(eq)) << (2 * i);
+    }
+  
+  return mask;
+#elif defined(__SSE2__)
+  __m128i ones = _mm_set1_epi32(-1);
+  int mask = 0;
+  int i;
+  
+  // SSE2 compares 32 bits at a time: a word is full when both halves are
+  for (i = 0; i < WORDS / 2; i++)
+    {
+      __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((__m128i*) bits + i), ones);
+      int halves = _mm_movemask_ps(_mm_castsi128_ps(eq));
+  
+      mask |= ((halves & 3) == 3) << (2 * i);
+      mask |= ((halves & 12) == 12) << (2 * i + 1);
+    }
+  
+  return mask;
+#else
+  int mask = 0;
+  int i;
+  
+  for (i = 0; i < WORDS; i++)
+    {
+      mask |= (bits[i] == ~0UL) << i;
+    }
+  
+  return mask;
+#endif
+}
+
+int
+find_run(unsigned long* bits, int n, int* longest)
+{
+  int open = ~full_words(bits) & ((1 << WORDS) - 1);
+  int pos = 0;
+  
+  *longest = 0;
+  while (open != 0)
+    {
+      int w = pos / WORDBITS;
+      unsigned long x = ~bits[w] & (~0UL << (pos % WORDBITS));
+      int start, end;
+  
+      // first free granule from pos, skipping the full words
+      if (x == 0)
+	{
+	  open &= ~0U << (w + 1);
+	  if (open == 0)
+	    {
+	      return -1;
+	    }
+	  w = __builtin_ctz(open);
+	  x = ~bits[w];
+	}
+      start = w * WORDBITS + __builtin_ctzl(x);
+  
+      // first granule in use after it
+      x = bits[w] & (~0UL << (start % WORDBITS));
+      while (x == 0 && ++w < WORDS)
+	{
+	  x = bits[w];
+	}
+      end = w == WORDS ? GRANULES : w * WORDBITS + __builtin_ctzl(x);
+  
+      if (end - start >= n)
+	{
+	  return start;
+	}
+      if (end - start > *longest)
+	{
+	  *longest = end - start;
+	}
+      if (end == GRANULES)
+	{
+	  return -1;
+	}
+      pos = end;
+    }
+  
+  return -1;
+}
+
+void
+set_run(unsigned long* bits, int start, int n, int used)
+{
+  // one mask per word the run touches
+  while (n > 0)
+    {
+      int w = start / WORDBITS;
+      int shift = start % WORDBITS;
+      int len = n < (int) WORDBITS - shift ? n : (int) WORDBITS - shift;
+      unsigned long mask = (len == WORDBITS ? ~0UL : ((1UL << len) - 1)) << shift;
+  
+      if (used)
+	{
+	  bits[w] |= mask;
+	}
+      else
+	{
+	  bits[w] &= ~mask;
+	}
+      start += len;
+      n -= len;
+    }
+}
+
+kma_page_t*
+new_page()
+{
+  kma_page_t* page = reclaim_page(&g_buckets);
+  
+  // a retained page still has its empty bitmap and count
+  if (page == NULL)
+    {
+      page = get_page();
+      page->owner = &g_buckets;
+      memset(BITMAP(page), 0, WORDS * sizeof(unsigned long));
+      set_run(BITMAP(page), 0, MAPGRANULES, 1);
+      page->nfree = MAXGRANULES;
+      page->sclass = 0;
+    }
+  set_bound(page, MAXGRANULES);
+  
+  return page;
+}
+
+void
+set_bound(kma_page_t* page, int bound)
+{
+  // a page is in a bucket while its bound is not 0
+  if (page->sclass > 0 && bound > 0 && BUCKET(page->sclass) == BUCKET(bound))
+    {
+      page->sclass = bound;
+      return;
+    }
+  if (page->sclass > 0)
+    {
+      unlink_page(page);
+    }
+  page->sclass = bound;
+  if (bound > 0)
+    {
+      link_page(page);
+    }
+}
+
+void
+link_page(kma_page_t* page)
+{
+  int b = BUCKET(page->sclass);
+  
+  page->prev = NULL;
+  page->next = g_buckets[b];
+  if (g_buckets[b] != NULL)
+    {
+      g_buckets[b]->prev = page;
+    }
+  g_buckets[b] = page;
+  g_nonempty |= 1U << b;
+}
+
+void
+unlink_page(kma_page_t* page)
+{
+  int b = BUCKET(page->sclass);
+  
+  if (page->prev != NULL)
+    {
+      page->prev->next = page->next;
+    }
+  else
+    {
+      g_buckets[b] = page->next;
+    }
+  if (page->next != NULL)
+    {
+      page->next->prev = page->prev;
+    }
+  if (g_buckets[b] == NULL)
+    {
+      g_nonempty &= ~(1U << b);
+    }
+}
+
+#endif // KMA_BMAP
@@ -36,7 +36,9 @@
 
 /************System include***********************************************/
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -49,9 +51,36 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/*  Every page is split into blocks of 2^(MINSHIFT + order) bytes, order
+ *  0 to MAXORDER. The smallest block at the start of each page holds the
+ *  page's buddy bitmap, which is never handed out: it has one bit per
+ *  pair of buddies (order by order), set while exactly one of the two
+ *  is free. Free blocks are kept on one list per order, linked through
+ *  the blocks themselves. Spaces larger than MAXBLOCK get pages of
+ *  their own.
+ */
+#define MINSHIFT 5
+#define MINBLOCK (1 << MINSHIFT)
+#define MAXORDER 7
+#define MAXBLOCK (MINBLOCK << MAXORDER)
+#define NUMBLOCKS (PAGESIZE / MINBLOCK)
+
+typedef struct free_block
+{
+  struct free_block* prev;
+  struct free_block* next;
+} free_block_t;
+
 /************Global Variables*********************************************/
+static free_block_t* g_freelist[MAXORDER + 1];
 
 /************Function Prototypes******************************************/
+int order_of(kma_size_t size);
+void new_page();
+int flip_pair(void* block, int order);
+int page_empty(unsigned char* map);
+void push_block(free_block_t* block, int order);
+void unlink_block(free_block_t* block, int order);
 	
 /************External Declaration*****************************************/
 
@@ -60,16 +89,204 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  if (entry_point == NULL) {
-	entry_point = get_page();
-	initialize_page(entry_point);
-  }
+  free_block_t* block;
+  int order, split;
+  
+  // a space larger than half a page gets contiguous pages of its own
+  if (size > MAXBLOCK)
+    {
+      kma_page_t* run = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      return run->ptr;
+    }
+  
+  // the smallest free block that is large enough
+  order = order_of(size);
+  for (split = order; split <= MAXORDER; split++)
+    {
+      if (g_freelist[split] != NULL)
+	{
+	  break;
+	}
+    }
+  if (split > MAXORDER)
+    {
+      // a new page has a free block of every order
+      new_page();
+      split = order;
+    }
+  
+  block = g_freelist[split];
+  unlink_block(block, split);
+  flip_pair(block, split);
+  
+  // split it down to size, keeping the upper halves free
+  while (split > order)
+    {
+      free_block_t* half;
+      
+      split--;
+      half = (free_block_t*) ((void*) block + (MINBLOCK << split));
+      push_block(half, split);
+      flip_pair(half, split);
+    }
+  
+  return block;
+}
+
+void*
+kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  void* ptr;
+  
+  if (size != 0 && nmemb > INT_MAX / size)
+    {
+      return NULL;
+    }
+  
+  // a large space gets pages that are zero already
+  if (nmemb * size > MAXBLOCK)
+    {
+      return get_zeroed_pages((nmemb * size + PAGESIZE - 1) / PAGESIZE)->ptr;
+    }
+  
+  ptr = kma_malloc(nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  
+  return ptr;
 }
 
 void 
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  void* base = BASEADDR(ptr);
+  free_block_t* block = (free_block_t*) ptr;
+  int order;
+  
+  if (size > MAXBLOCK)
+    {
+      free_pages(page_of(ptr));
+      return;
+    }
+  
+  // merge with the buddy for as long as it is free too; the pair bit
+  // is then clear again, since neither half is on a free list
+  order = order_of(size);
+  while (flip_pair(block, order) == 0)
+    {
+      free_block_t* buddy = (free_block_t*)
+	(base + (((void*) block - base) ^ (MINBLOCK << order)));
+      
+      unlink_block(buddy, order);
+      if (buddy < block)
+	{
+	  block = buddy;
+	}
+      order++;
+    }
+  push_block(block, order);
+  
+  // a page whose blocks are all free again holds only the bitmap and
+  // the free buddies of its ancestors, one of each order
+  if (page_empty((unsigned char*) base))
+    {
+      for (order = 0; order <= MAXORDER; order++)
+	{
+	  unlink_block((free_block_t*) (base + (MINBLOCK << order)), order);
+	}
+      free_page(page_of(base));
+    }
+}
+
+int
+order_of(kma_size_t size)
+{
+  if (size <= MINBLOCK)
+    {
+      return 0;
+    }
+  
+  return (8 * sizeof(int) - __builtin_clz(size - 1)) - MINSHIFT;
+}
+
+void
+new_page()
+{
+  kma_page_t* page = get_page();
+  void* base = page->ptr;
+  int order;
+  
+  // the first block holds the bitmap; its buddy and the buddies of all
+  // its ancestors are free
+  memset(base, 0, MINBLOCK);
+  for (order = MAXORDER; order >= 0; order--)
+    {
+      free_block_t* block = (free_block_t*) (base + (MINBLOCK << order));
+      
+      push_block(block, order);
+      flip_pair(block, order);
+    }
+}
+
+int
+flip_pair(void* block, int order)
+{
+  unsigned char* map = (unsigned char*) BASEADDR(block);
+  int offset = block - (void*) map;
+  // the pairs of order 0 come first, then those of order 1, and so on
+  int bit = (NUMBLOCKS - (NUMBLOCKS >> order))
+    + (offset >> (MINSHIFT + order + 1));
+  
+  map[bit / 8] ^= 1 << (bit % 8);
+  
+  return (map[bit / 8] >> (bit % 8)) & 1;
+}
+
+int
+page_empty(unsigned char* map)
+{
+  int order, bit;
+  
+  // the bitmap block and its ancestors are in use, so the page is empty
+  // when the first pair of every order has exactly one free block
+  for (order = 0; order <= MAXORDER; order++)
+    {
+      bit = NUMBLOCKS - (NUMBLOCKS >> order);
+      if (((map[bit / 8] >> (bit % 8)) & 1) == 0)
+	{
+	  return 0;
+	}
+    }
+  
+  return 1;
+}
+
+void
+push_block(free_block_t* block, int order)
+{
+  block->prev = NULL;
+  block->next = g_freelist[order];
+  if (block->next != NULL)
+    {
+      block->next->prev = block;
+    }
+  g_freelist[order] = block;
+}
+
+void
+unlink_block(free_block_t* block, int order)
+{
+  if (block->prev != NULL)
+    {
+      block->prev->next = block->next;
+    }
+  else
+    {
+      g_freelist[order] = block->next;
+    }
+  if (block->next != NULL)
+    {
+      block->next->prev = block->prev;
+    }
 }
 
 #endif // KMA_BUD
@@ -45,6 +45,7 @@
 
 /************System include***********************************************/
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 
 /************Private include**********************************************/
@@ -70,17 +71,10 @@ void* kma_malloc(kma_size_t size)
 {
   kma_page_t* page;
   
-  // get one page
-  page = get_page();
-  
-  // add a pointer to the page structure at the beginning of the page
-  *((kma_page_t**)page->ptr) = page;
-  
-  if ((size + sizeof(kma_page_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
-      return NULL;
-    }
+  // get enough contiguous pages for the request; the page structure is
+  // found again through the frame table, so the request gets all of it.
+  // Even an empty request needs a page of its own to point into
+  page = get_pages(size != 0 ? (size + PAGESIZE - 1) / PAGESIZE : 1);
   
   // check whether the BASEADDR macro works
   //for (i = 0; i < page->size; i++)
@@ -89,16 +83,31 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
-  return page->ptr + sizeof(kma_page_t*);
+  return page->ptr;
+}
+
+void* kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  kma_page_t* page;
+  
+  if (size != 0 && nmemb > INT_MAX / size)
+    {
+      return NULL;
+    }
+  
+  // the page allocator hands out pages that are zero already
+  page = get_zeroed_pages(nmemb * size != 0 ? (nmemb * size + PAGESIZE - 1) / PAGESIZE : 1);
+  
+  return page->ptr;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 {
   kma_page_t* page;
   
-  page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
+  page = page_of(ptr);
   
-  free_page(page);
+  free_pages(page);
 }
 
 #endif // KMA_DUMMY
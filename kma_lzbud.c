@@ -37,7 +37,9 @@
 
 /************System include***********************************************/
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -50,9 +52,63 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/*  The pages are laid out as in the buddy system (kma_bud.c): blocks of
+ *  2^(MINSHIFT + order) bytes, a buddy bitmap in the first block of
+ *  every page, and a list of globally free (coalesced) blocks per
+ *  order. On top of that, freed blocks may stay locally free: still
+ *  marked in use in the bitmap and kept on a list of their own, ready
+ *  to be handed out again without any splitting or coalescing.
+ *
+ *  Per order, slack = allocated - locally free decides how a block is
+ *  freed (SVR4): with a slack of two or more it stays locally free,
+ *  with one it is coalesced, and with none it is coalesced together
+ *  with one locally free block. On top of that the locally free blocks
+ *  of an order are held to its demand, the rate of allocations per
+ *  window: an order in steady demand keeps up to that many blocks
+ *  locally free, and one whose demand drops coalesces like the
+ *  accelerated state until it is back under its watermark.
+ */
+#define MINSHIFT 5
+#define MINBLOCK (1 << MINSHIFT)
+#define MAXORDER 7
+#define MAXBLOCK (MINBLOCK << MAXORDER)
+#define NUMBLOCKS (PAGESIZE / MINBLOCK)
+
+// calls per window of the allocation rate
+#define WINDOW 256
+
+typedef struct free_block
+{
+  struct free_block* prev;
+  struct free_block* next;
+} free_block_t;
+
+typedef struct
+{
+  free_block_t* global; // coalesced free blocks, doubly linked
+  free_block_t* local; // locally free blocks, linked through next
+  int allocated; // blocks handed out
+  int nlocal; // blocks on the local list
+  int allocs; // allocations in the current window
+  int rate; // allocations per window, smoothed: the local watermark
+} order_t;
+
 /************Global Variables*********************************************/
+static order_t g_orders[MAXORDER + 1];
+static int g_inuse = 0; // blocks handed out, all orders
+static int g_calls = 0; // calls in the current window
 
 /************Function Prototypes******************************************/
+int order_of(kma_size_t size);
+void* alloc_global(int order);
+void free_global(free_block_t* block, int order);
+void drain_local();
+void update_rates();
+void new_page();
+int flip_pair(void* block, int order);
+int page_empty(unsigned char* map);
+void push_block(free_block_t* block, int order);
+void unlink_block(free_block_t* block, int order);
 
 /************External Declaration*****************************************/
 
@@ -61,13 +117,312 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  order_t* class;
+  void* block;
+  
+  // a space larger than half a page gets contiguous pages of its own
+  if (size > MAXBLOCK)
+    {
+      kma_page_t* run = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      return run->ptr;
+    }
+  
+  update_rates();
+  
+  class = &g_orders[order_of(size)];
+  if (class->local != NULL)
+    {
+      // a locally free block needs no splitting
+      block = class->local;
+      class->local = class->local->next;
+      class->nlocal--;
+    }
+  else
+    {
+      block = alloc_global(class - g_orders);
+    }
+  
+  class->allocated++;
+  class->allocs++;
+  g_inuse++;
+  
+  return block;
+}
+
+void*
+kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  void* ptr;
+  
+  if (size != 0 && nmemb > INT_MAX / size)
+    {
+      return NULL;
+    }
+  
+  // a large space gets pages that are zero already
+  if (nmemb * size > MAXBLOCK)
+    {
+      return get_zeroed_pages((nmemb * size + PAGESIZE - 1) / PAGESIZE)->ptr;
+    }
+  
+  ptr = kma_malloc(nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  
+  return ptr;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  free_block_t* block = (free_block_t*) ptr;
+  order_t* class;
+  int order, slack;
+  
+  if (size > MAXBLOCK)
+    {
+      free_pages(page_of(ptr));
+      return;
+    }
+  
+  update_rates();
+  
+  order = order_of(size);
+  class = &g_orders[order];
+  slack = class->allocated - class->nlocal;
+  class->allocated--;
+  g_inuse--;
+  
+  if (g_inuse == 0)
+    {
+      // nothing is in use any more: coalesce everything, so all pages
+      // go back
+      free_global(block, order);
+      drain_local();
+    }
+  else if (slack >= 2 && class->nlocal < class->rate)
+    {
+      // lazy: keep it locally free
+      block->next = class->local;
+      class->local = block;
+      class->nlocal++;
+    }
+  else
+    {
+      // reclaiming: coalesce it; accelerated, or above the watermark:
+      // one locally free block too
+      free_global(block, order);
+      if ((slack <= 0 || class->nlocal > class->rate) && class->local != NULL)
+	{
+	  block = class->local;
+	  class->local = block->next;
+	  class->nlocal--;
+	  free_global(block, order);
+	}
+    }
+}
+
+int
+order_of(kma_size_t size)
+{
+  if (size <= MINBLOCK)
+    {
+      return 0;
+    }
+  
+  return (8 * sizeof(int) - __builtin_clz(size - 1)) - MINSHIFT;
+}
+
+void*
+alloc_global(int order)
+{
+  free_block_t* block;
+  int split;
+  
+  // the smallest globally free block that is large enough
+  for (split = order; split <= MAXORDER; split++)
+    {
+      if (g_orders[split].global != NULL)
+	{
+	  break;
+	}
+    }
+  if (split > MAXORDER)
+    {
+      // a new page has a free block of every order
+      new_page();
+      split = order;
+    }
+  
+  block = g_orders[split].global;
+  unlink_block(block, split);
+  flip_pair(block, split);
+  
+  // split it down to size, keeping the upper halves free
+  while (split > order)
+    {
+      free_block_t* half;
+      
+      split--;
+      half = (free_block_t*) ((void*) block + (MINBLOCK << split));
+      push_block(half, split);
+      flip_pair(half, split);
+    }
+  
+  return block;
+}
+
+void
+free_global(free_block_t* block, int order)
+{
+  void* base = BASEADDR(block);
+  
+  // merge with the buddy for as long as it is free too; the pair bit
+  // is then clear again, since neither half is on a free list
+  while (flip_pair(block, order) == 0)
+    {
+      free_block_t* buddy = (free_block_t*)
+	(base + (((void*) block - base) ^ (MINBLOCK << order)));
+      
+      unlink_block(buddy, order);
+      if (buddy < block)
+	{
+	  block = buddy;
+	}
+      order++;
+    }
+  push_block(block, order);
+  
+  // a page whose blocks are all free again holds only the bitmap and
+  // the free buddies of its ancestors, one of each order
+  if (page_empty((unsigned char*) base))
+    {
+      for (order = 0; order <= MAXORDER; order++)
+	{
+	  unlink_block((free_block_t*) (base + (MINBLOCK << order)), order);
+	}
+      free_page(page_of(base));
+    }
+}
+
+void
+drain_local()
+{
+  int order;
+  
+  for (order = 0; order <= MAXORDER; order++)
+    {
+      order_t* class = &g_orders[order];
+      
+      while (class->local != NULL)
+	{
+	  free_block_t* block = class->local;
+	  
+	  class->local = block->next;
+	  free_global(block, order);
+	}
+      class->nlocal = 0;
+    }
+}
+
+void
+update_rates()
+{
+  int order;
+  
+  if (++g_calls < WINDOW)
+    {
+      return;
+    }
+  g_calls = 0;
+  
+  for (order = 0; order <= MAXORDER; order++)
+    {
+      order_t* class = &g_orders[order];
+      
+      class->rate = (3 * class->rate + class->allocs) / 4;
+      class->allocs = 0;
+    }
+}
+
+void
+new_page()
+{
+  kma_page_t* page = get_page();
+  void* base = page->ptr;
+  int order;
+  
+  // the first block holds the bitmap; its buddy and the buddies of all
+  // its ancestors are free
+  memset(base, 0, MINBLOCK);
+  for (order = MAXORDER; order >= 0; order--)
+    {
+      free_block_t* block = (free_block_t*) (base + (MINBLOCK << order));
+      
+      push_block(block, order);
+      flip_pair(block, order);
+    }
+}
+
+int
+flip_pair(void* block, int order)
+{
+  unsigned char* map = (unsigned char*) BASEADDR(block);
+  int offset = block - (void*) map;
+  // the pairs of order 0 come first, then those of order 1, and so on
+  int bit = (NUMBLOCKS - (NUMBLOCKS >> order))
+    + (offset >> (MINSHIFT + order + 1));
+  
+  map[bit / 8] ^= 1 << (bit % 8);
+  
+  return (map[bit / 8] >> (bit % 8)) & 1;
+}
+
+int
+page_empty(unsigned char* map)
+{
+  int order, bit;
+  
+  // the bitmap block and its ancestors are in use, so the page is empty
+  // when the first pair of every order has exactly one free block
+  for (order = 0; order <= MAXORDER; order++)
+    {
+      bit = NUMBLOCKS - (NUMBLOCKS >> order);
+      if (((map[bit / 8] >> (bit % 8)) & 1) == 0)
+	{
+	  return 0;
+	}
+    }
+  
+  return 1;
+}
+
+void
+push_block(free_block_t* block, int order)
+{
+  block->prev = NULL;
+  block->next = g_orders[order].global;
+  if (block->next != NULL)
+    {
+      block->next->prev = block;
+    }
+  g_orders[order].global = block;
+}
+
+void
+unlink_block(free_block_t* block, int order)
+{
+  if (block->prev != NULL)
+    {
+      block->prev->next = block->next;
+    }
+  else
+    {
+      g_orders[order].global = block->next;
+    }
+  if (block->next != NULL)
+    {
+      block->next->prev = block->prev;
+    }
 }
 
 #endif // KMA_LZBUD
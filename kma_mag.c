@@ -0,0 +1,735 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Magazine layer in front of the kernel memory allocator
+ *             picked at build time
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.2  2009/10/31 21:28:52  jot836
+ *    This is the current version of KMA project 3.
+ *    It includes:
+ *    - the most up-to-date handout (F'09)
+ *    - updated skeleton including
+ *        file-driven test harness,
+ *        trace generator script,
+ *        support for evaluating efficiency of algorithm (wasted memory),
+ *        gnuplot support for plotting allocation and waste,
+ *        set of traces for all students to use (including a makefile and README of the settings),
+ *    - different version of the testsuite for use on the submission site, including:
+ *        scoreboard Python scripts, which posts the top 5 scores on the course webpage
+ *
+ *    Revision 1.1  2005/10/24 16:07:09  sbirrer
+ *    - skeleton
+ *
+ *    Revision 1.2  2004/11/05 15:45:56  sbirrer
+ *    - added size as a parameter to kma_free
+ *
+ *    Revision 1.1  2004/11/03 23:04:03  sbirrer
+ *    - initial version for the kernel memory allocator project
+ *
+ ***************************************************************************/
+#ifdef KMA_MAGAZINE
+#define __KMA_IMPL__
+#define __KMA_MAG_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*  Every thread keeps two magazines (stacks of free objects) per size
+ *  class: the loaded one serves kma_malloc and kma_free, and the
+ *  previous one is swapped in when the loaded one runs empty or full,
+ *  so a thread only goes to the depot every so many calls. The depot
+ *  of a class keeps full and empty magazines under a lock of its own;
+ *  the backend (the algorithm built with -DKMA_MAGAZINE, see kma.h) is
+ *  called under a single lock, so it need not be thread safe.
+ *
+ *  Requests are rounded up to their class, so an object always goes
+ *  back to the backend with the size it was taken with. Requests above
+ *  MAXCACHED go to the backend directly.
+ *
+ *  A depot counts how often its lock was contended; when that is more
+ *  than 1/CONTENDFRAC of its operations over a window of WINDOW, its
+ *  new magazines get twice the rounds, up to MAXROUNDS; when it drops
+ *  below 1/CALMFRAC, they get half, down to the rounds they started
+ *  with. A depot keeps at most MAXFULL full magazines. Magazines the
+ *  depot did not need during a window go back to the backend. Once no
+ *  more objects are in use than sit in magazines, the depots and the
+ *  magazines of the thread freeing one are drained.
+ */
+#define NUMCLASSES 20
+#define MAXCACHED 1024
+#define MAXTHREADS 64
+
+// rounds of the first magazines: about MAGBYTES worth of objects
+#define MAGBYTES 4096
+#define MINROUNDS 2
+#define INITROUNDS 16
+#define MAXROUNDS 64
+
+// full magazines a depot keeps at most
+#define MAXFULL 4
+
+#define WINDOW 64
+#define CONTENDFRAC 16
+#define CALMFRAC 64
+
+typedef struct magazine
+{
+  struct magazine* next;
+  int rounds;
+  int capacity;
+  void* round[];
+} magazine_t;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  // rounds of new magazines, and of the first ones
+  int capacity;
+  int initial;
+  magazine_t* full;
+  magazine_t* empty;
+  int nfull;
+  int nempty;
+  // objects in its full magazines
+  int rounds;
+  // fewest magazines on hand during this window
+  int minfull;
+  int minempty;
+  int ops;
+  int contended;
+  int exchanges;
+  int num_contended;
+} depot_t;
+
+typedef struct
+{
+  magazine_t* loaded;
+  magazine_t* previous;
+} mag_pair_t;
+
+// the magazines of a thread; live counts the objects it took minus the
+// ones it gave back, cached the objects in its magazines
+typedef struct
+{
+  mag_pair_t classes[NUMCLASSES];
+  long live;
+  long cached;
+  int users;
+} mag_thread_t;
+
+/************Global Variables*********************************************/
+static const int kClassSizes[NUMCLASSES] =
+  {
+      16,   32,   48,   64,   80,   96,  112,  128,
+     160,  192,  224,  256,  320,  384,  448,  512,
+     640,  768,  896, 1024
+  };
+
+static depot_t g_depots[NUMCLASSES];
+static pthread_once_t g_depots_once = PTHREAD_ONCE_INIT;
+
+static mag_thread_t g_threads[MAXTHREADS];
+static int g_num_threads = 0;
+static pthread_mutex_t g_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread mag_thread_t* g_self = NULL;
+static pthread_key_t g_self_key;
+
+static pthread_mutex_t g_backend_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_backend_calls = 0;
+
+/************Function Prototypes******************************************/
+void* kma_backend_malloc(kma_size_t size);
+void* kma_backend_calloc(kma_size_t nmemb, kma_size_t size);
+void kma_backend_free(void* ptr, kma_size_t size);
+
+int mag_class(kma_size_t size);
+void init_depots();
+mag_thread_t* attach_thread();
+void detach_thread(void* arg);
+void* backend_malloc(kma_size_t size);
+void backend_free(void* ptr, kma_size_t size);
+magazine_t* new_magazine(int capacity);
+void drain_magazine(magazine_t* mag, int class, int keep);
+void lock_depot(depot_t* depot);
+void unlock_depot(depot_t* depot, int class);
+magazine_t* pop_magazine(magazine_t** list, int* count, int* min);
+void push_magazine(magazine_t** list, int* count, magazine_t* mag);
+void drain_list(magazine_t* list, int class);
+int all_idle();
+int mostly_idle();
+void drain_all(mag_thread_t* self);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  mag_thread_t* self = attach_thread();
+  mag_pair_t* pair;
+  magazine_t* mag;
+  depot_t* depot;
+  int class;
+  
+  if (size > MAXCACHED)
+    {
+      return backend_malloc(size);
+    }
+  
+  class = mag_class(size);
+  if (self == NULL)
+    {
+      return backend_malloc(kClassSizes[class]);
+    }
+  
+  pair = &self->classes[class];
+  __atomic_store_n(&self->live, self->live + 1, __ATOMIC_RELAXED);
+  
+  if (pair->loaded != NULL && pair->loaded->rounds > 0)
+    {
+      __atomic_store_n(&self->cached, self->cached - 1, __ATOMIC_RELAXED);
+      return pair->loaded->round[--pair->loaded->rounds];
+    }
+  if (pair->previous != NULL && pair->previous->rounds > 0)
+    {
+      mag = pair->loaded;
+      pair->loaded = pair->previous;
+      pair->previous = mag;
+      __atomic_store_n(&self->cached, self->cached - 1, __ATOMIC_RELAXED);
+      return pair->loaded->round[--pair->loaded->rounds];
+    }
+  
+  // trade the empty previous magazine for a full one
+  depot = &g_depots[class];
+  lock_depot(depot);
+  mag = pop_magazine(&depot->full, &depot->nfull, &depot->minfull);
+  if (mag != NULL)
+    {
+      if (pair->previous != NULL)
+	{
+	  push_magazine(&depot->empty, &depot->nempty, pair->previous);
+	}
+      pair->previous = pair->loaded;
+      pair->loaded = mag;
+      depot->rounds -= mag->rounds;
+      depot->exchanges++;
+    }
+  unlock_depot(depot, class);
+  
+  if (mag == NULL)
+    {
+      return backend_malloc(kClassSizes[class]);
+    }
+  
+  __atomic_store_n(&self->cached, self->cached + mag->rounds - 1, __ATOMIC_RELAXED);
+  return mag->round[--mag->rounds];
+}
+
+void*
+kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  void* ptr;
+  
+  if (size != 0 && nmemb > INT_MAX / size)
+    {
+      return NULL;
+    }
+  
+  // the backend knows best how to get large zeroed spaces
+  if (nmemb * size > MAXCACHED)
+    {
+      pthread_mutex_lock(&g_backend_lock);
+      g_backend_calls++;
+      ptr = kma_backend_calloc(nmemb, size);
+      pthread_mutex_unlock(&g_backend_lock);
+      return ptr;
+    }
+  
+  ptr = kma_malloc(nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  mag_thread_t* self = attach_thread();
+  mag_pair_t* pair;
+  magazine_t* mag;
+  depot_t* depot;
+  int class;
+  
+  if (size > MAXCACHED)
+    {
+      backend_free(ptr, size);
+      return;
+    }
+  
+  class = mag_class(size);
+  if (self == NULL)
+    {
+      backend_free(ptr, kClassSizes[class]);
+      return;
+    }
+  
+  pair = &self->classes[class];
+  __atomic_store_n(&self->live, self->live - 1, __ATOMIC_RELAXED);
+  
+  if (pair->loaded == NULL || pair->loaded->rounds == pair->loaded->capacity)
+    {
+      if (pair->previous != NULL && pair->previous->rounds == 0)
+	{
+	  mag = pair->loaded;
+	  pair->loaded = pair->previous;
+	  pair->previous = mag;
+	}
+      else
+	{
+	  depot = &g_depots[class];
+	  lock_depot(depot);
+	  if (pair->previous != NULL && depot->nfull >= MAXFULL)
+	    {
+	      // the depot has full magazines enough: the rounds of the
+	      // previous one go back to the backend instead
+	      mag = pair->previous;
+	    }
+	  else
+	    {
+	      // trade the full previous magazine for an empty one
+	      mag = pop_magazine(&depot->empty, &depot->nempty, &depot->minempty);
+	      if (mag == NULL)
+		{
+		  mag = new_magazine(depot->capacity);
+		}
+	      if (mag != NULL && pair->previous != NULL)
+		{
+		  push_magazine(&depot->full, &depot->nfull, pair->previous);
+		  depot->rounds += pair->previous->rounds;
+		  __atomic_store_n(&self->cached, self->cached - pair->previous->rounds, __ATOMIC_RELAXED);
+		  depot->exchanges++;
+		}
+	    }
+	  if (mag != NULL)
+	    {
+	      pair->previous = pair->loaded;
+	      pair->loaded = mag;
+	    }
+	  unlock_depot(depot, class);
+	  
+	  if (mag == NULL)
+	    {
+	      backend_free(ptr, kClassSizes[class]);
+	      return;
+	    }
+	  if (mag->rounds > 0)
+	    {
+	      __atomic_store_n(&self->cached, self->cached - mag->rounds, __ATOMIC_RELAXED);
+	      drain_magazine(mag, class, TRUE);
+	    }
+	}
+    }
+  
+  pair->loaded->round[pair->loaded->rounds++] = ptr;
+  __atomic_store_n(&self->cached, self->cached + 1, __ATOMIC_RELAXED);
+  
+  // what the magazines hold should not outweigh what is in use
+  if (self->live <= self->cached && mostly_idle())
+    {
+      drain_all(self);
+    }
+}
+
+kma_mag_stat_t*
+mag_stats()
+{
+  static kma_mag_stat_t stats;
+  int i;
+  
+  memset(&stats, 0, sizeof(stats));
+  
+  pthread_mutex_lock(&g_backend_lock);
+  stats.num_backend = g_backend_calls;
+  pthread_mutex_unlock(&g_backend_lock);
+  
+  pthread_once(&g_depots_once, init_depots);
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      pthread_mutex_lock(&g_depots[i].lock);
+      stats.num_exchanges += g_depots[i].exchanges;
+      stats.num_contended += g_depots[i].num_contended;
+      if (g_depots[i].capacity > stats.max_rounds)
+	{
+	  stats.max_rounds = g_depots[i].capacity;
+	}
+      pthread_mutex_unlock(&g_depots[i].lock);
+    }
+  
+  return &stats;
+}
+
+int
+mag_class(kma_size_t size)
+{
+  int shift;
+  
+  // 16 byte steps up to 128, then four classes per power of two
+  if (size <= 128)
+    {
+      return (size > 0) ? (size - 1) >> 4 : 0;
+    }
+  
+  shift = 8 * sizeof(int) - 1 - __builtin_clz(size - 1);
+  return 8 + (shift - 7) * 4 + (((size - 1) >> (shift - 2)) & 3);
+}
+
+void
+init_depots()
+{
+  int i;
+  
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      pthread_mutex_init(&g_depots[i].lock, NULL);
+      g_depots[i].capacity = MAGBYTES / kClassSizes[i];
+      if (g_depots[i].capacity < MINROUNDS)
+	{
+	  g_depots[i].capacity = MINROUNDS;
+	}
+      if (g_depots[i].capacity > INITROUNDS)
+	{
+	  g_depots[i].capacity = INITROUNDS;
+	}
+      g_depots[i].initial = g_depots[i].capacity;
+    }
+  
+  pthread_key_create(&g_self_key, detach_thread);
+}
+
+mag_thread_t*
+attach_thread()
+{
+  mag_thread_t* self = g_self;
+  int i;
+  
+  if (self != NULL)
+    {
+      return self;
+    }
+  
+  pthread_once(&g_depots_once, init_depots);
+  
+  // reuse the slot of a thread that has exited, else take a new one;
+  // once all are taken, threads go to the backend directly
+  pthread_mutex_lock(&g_threads_lock);
+  for (i = 0; i < g_num_threads; i++)
+    {
+      if (g_threads[i].users == 0)
+	{
+	  self = &g_threads[i];
+	  break;
+	}
+    }
+  if (self == NULL && g_num_threads < MAXTHREADS)
+    {
+      self = &g_threads[g_num_threads++];
+    }
+  if (self != NULL)
+    {
+      self->users = 1;
+    }
+  pthread_mutex_unlock(&g_threads_lock);
+  
+  if (self != NULL)
+    {
+      g_self = self;
+      pthread_setspecific(g_self_key, self);
+    }
+  
+  return self;
+}
+
+void
+detach_thread(void* arg)
+{
+  mag_thread_t* self = (mag_thread_t*) arg;
+  int i;
+  
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      drain_magazine(self->classes[i].loaded, i, FALSE);
+      drain_magazine(self->classes[i].previous, i, FALSE);
+      self->classes[i].loaded = NULL;
+      self->classes[i].previous = NULL;
+    }
+  __atomic_store_n(&self->cached, 0, __ATOMIC_RELAXED);
+  
+  if (all_idle())
+    {
+      drain_all(self);
+    }
+  
+  pthread_mutex_lock(&g_threads_lock);
+  self->users = 0;
+  pthread_mutex_unlock(&g_threads_lock);
+}
+
+void*
+backend_malloc(kma_size_t size)
+{
+  void* ptr;
+  
+  pthread_mutex_lock(&g_backend_lock);
+  g_backend_calls++;
+  ptr = kma_backend_malloc(size);
+  pthread_mutex_unlock(&g_backend_lock);
+  
+  return ptr;
+}
+
+void
+backend_free(void* ptr, kma_size_t size)
+{
+  pthread_mutex_lock(&g_backend_lock);
+  g_backend_calls++;
+  kma_backend_free(ptr, size);
+  pthread_mutex_unlock(&g_backend_lock);
+}
+
+magazine_t*
+new_magazine(int capacity)
+{
+  magazine_t* mag;
+  
+  // magazines come from the backend too, so they count as used memory
+  mag = backend_malloc(sizeof(magazine_t) + capacity * sizeof(void*));
+  if (mag != NULL)
+    {
+      mag->rounds = 0;
+      mag->capacity = capacity;
+    }
+  
+  return mag;
+}
+
+void
+drain_magazine(magazine_t* mag, int class, int keep)
+{
+  int i;
+  
+  if (mag == NULL)
+    {
+      return;
+    }
+  
+  // one trip to the backend for all rounds
+  pthread_mutex_lock(&g_backend_lock);
+  for (i = 0; i < mag->rounds; i++)
+    {
+      kma_backend_free(mag->round[i], kClassSizes[class]);
+    }
+  g_backend_calls += mag->rounds;
+  mag->rounds = 0;
+  if (!keep)
+    {
+      kma_backend_free(mag, sizeof(magazine_t) + mag->capacity * sizeof(void*));
+      g_backend_calls++;
+    }
+  pthread_mutex_unlock(&g_backend_lock);
+}
+
+void
+lock_depot(depot_t* depot)
+{
+  if (pthread_mutex_trylock(&depot->lock) != 0)
+    {
+      pthread_mutex_lock(&depot->lock);
+      depot->contended++;
+      depot->num_contended++;
+    }
+  depot->ops++;
+}
+
+void
+unlock_depot(depot_t* depot, int class)
+{
+  magazine_t* full = NULL;
+  magazine_t* empty = NULL;
+  
+  if (depot->ops >= WINDOW)
+    {
+      if (depot->contended * CONTENDFRAC > depot->ops && depot->capacity < MAXROUNDS)
+	{
+	  depot->capacity *= 2;
+	  if (depot->capacity > MAXROUNDS)
+	    {
+	      depot->capacity = MAXROUNDS;
+	    }
+	}
+      else if (depot->contended * CALMFRAC < depot->ops && depot->capacity > depot->initial)
+	{
+	  depot->capacity /= 2;
+	  if (depot->capacity < depot->initial)
+	    {
+	      depot->capacity = depot->initial;
+	    }
+	}
+  
+      // the magazines that sat in the depot all window long
+      for (; depot->minfull > 0; depot->minfull--)
+	{
+	  magazine_t* mag = depot->full;
+  
+	  depot->full = mag->next;
+	  depot->nfull--;
+	  depot->rounds -= mag->rounds;
+	  mag->next = full;
+	  full = mag;
+	}
+      for (; depot->minempty > 0; depot->minempty--)
+	{
+	  magazine_t* mag = depot->empty;
+  
+	  depot->empty = mag->next;
+	  depot->nempty--;
+	  mag->next = empty;
+	  empty = mag;
+	}
+  
+      depot->ops = 0;
+      depot->contended = 0;
+      depot->minfull = depot->nfull;
+      depot->minempty = depot->nempty;
+    }
+  pthread_mutex_unlock(&depot->lock);
+  
+  drain_list(full, class);
+  drain_list(empty, class);
+}
+
+magazine_t*
+pop_magazine(magazine_t** list, int* count, int* min)
+{
+  magazine_t* mag = *list;
+  
+  if (mag != NULL)
+    {
+      *list = mag->next;
+      (*count)--;
+      if (*count < *min)
+	{
+	  *min = *count;
+	}
+    }
+  
+  return mag;
+}
+
+void
+push_magazine(magazine_t** list, int* count, magazine_t* mag)
+{
+  mag->next = *list;
+  *list = mag;
+  (*count)++;
+}
+
+void
+drain_list(magazine_t* list, int class)
+{
+  while (list != NULL)
+    {
+      magazine_t* next = list->next;
+  
+      drain_magazine(list, class, FALSE);
+      list = next;
+    }
+}
+
+int
+all_idle()
+{
+  long live = 0;
+  int i;
+  
+  // a racy sum; it only decides when to drain
+  for (i = 0; i < __atomic_load_n(&g_num_threads, __ATOMIC_RELAXED); i++)
+    {
+      live += __atomic_load_n(&g_threads[i].live, __ATOMIC_RELAXED);
+    }
+  
+  return live == 0;
+}
+
+int
+mostly_idle()
+{
+  long live = 0;
+  long cached = 0;
+  int i;
+  
+  // racy sums as well
+  for (i = 0; i < __atomic_load_n(&g_num_threads, __ATOMIC_RELAXED); i++)
+    {
+      live += __atomic_load_n(&g_threads[i].live, __ATOMIC_RELAXED);
+      cached += __atomic_load_n(&g_threads[i].cached, __ATOMIC_RELAXED);
+    }
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      cached += __atomic_load_n(&g_depots[i].rounds, __ATOMIC_RELAXED);
+    }
+  
+  return live <= cached;
+}
+
+void
+drain_all(mag_thread_t* self)
+{
+  int i;
+  
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      depot_t* depot = &g_depots[i];
+      magazine_t* full;
+      magazine_t* empty;
+  
+      drain_magazine(self->classes[i].loaded, i, FALSE);
+      drain_magazine(self->classes[i].previous, i, FALSE);
+      self->classes[i].loaded = NULL;
+      self->classes[i].previous = NULL;
+  
+      pthread_mutex_lock(&depot->lock);
+      full = depot->full;
+      empty = depot->empty;
+      depot->full = NULL;
+      depot->empty = NULL;
+      depot->nfull = depot->minfull = 0;
+      depot->nempty = depot->minempty = 0;
+      depot->rounds = 0;
+      pthread_mutex_unlock(&depot->lock);
+  
+      drain_list(full, i);
+      drain_list(empty, i);
+    }
+  __atomic_store_n(&self->cached, 0, __ATOMIC_RELAXED);
+}
+
+#endif // KMA_MAGAZINE
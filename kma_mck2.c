@@ -37,7 +37,9 @@
 
 /************System include***********************************************/
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -50,55 +52,36 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-// struct used as header of each buffer
-typedef struct 
+/*  Buffers come in powers of two from MINBUF to MAXBUF bytes, and every
+ *  page holds buffers of a single size. The size of each page is kept
+ *  in its descriptor (sclass, our kmemsizes table), so kma_free finds
+ *  the right free list without a header in front of the buffer: a
+ *  buffer gets its full size. Each page keeps its own free buffers, and
+ *  the pages of a size with free buffers are kept on a list, so a page
+ *  whose buffers are all free can be returned on its own. Larger spaces
+ *  get pages of their own, marked LARGE.
+ */
+#define MINSHIFT 5
+#define MINBUF (1 << MINSHIFT)
+#define NUMCLASSES 8
+#define MAXBUF (MINBUF << (NUMCLASSES - 1))
+#define LARGE (-1)
+
+// link of a free buffer
+typedef struct buffer
 {
-  void * nextblock;
+  struct buffer* next;
 } buffer_t;
 
-typedef struct
-{
-  buffer_t* header;
-} buffer_list_t;
-
-typedef struct page_node_struct
-{
-  kma_page_t* page;
-  struct page_node_struct* next; 
-} page_node_t;
-
-typedef struct pagehead
-{
-  int num_alloc;
-  int size;
-  void* ptr;
-  void* next_block;
-  struct pagehead* next_page; 
-} page_header_t; 
-
-typedef struct 
-{
-  page_header_t header;
-  int page_num;
-  buffer_list_t freelist[10];
-  page_header_t* header;
-} mainpage_t;
-
 /************Global Variables*********************************************/
-kma_page_t* entrypage;
-/************Function Prototypes******************************************/
-kma_page_t* init_entrypage(kma_page_t* page);
-kma_page_t* init_page(kma_page_t* page, kma_size_t size); 
-
-void* search_bins(kma_size_t size); 
-void* search_pages(kma_size_t size);
+// pages with free buffers, per size
+static kma_page_t* g_partial[NUMCLASSES];
 
-void remove_allocation(void* ptr);
-void clear_bins(kma_page_t* page);
-
-int page_number(long val, long fp_header);
-size_t hash(size_t size); 
-kma_size_t blk_size(kma_size_t size);
+/************Function Prototypes******************************************/
+int size_class(kma_size_t size);
+kma_page_t* init_page(int class);
+void link_page(kma_page_t* page);
+void unlink_page(kma_page_t* page);
 
 /************External Declaration*****************************************/
 
@@ -107,52 +90,156 @@ kma_size_t blk_size(kma_size_t size);
 void*
 kma_malloc(kma_size_t size)
 {
-  if((size+sizeof(kma_page_t*)) > PAGESIZE) {
-    return NULL;
-  }
-  if(entrypage == NULL) {
-    // initialize the entry page
-    entrypage = init_entrypage(get_page());
-  }
-
-  // Entry page header set 
-  mainpage_t* entrypage_header = (mainpage_t*)(entrypage->ptr);
-  kma_size_t alloc_size = blksize(size);
-
-  // Search through the bins 
-  void* alloc = search_bins(size); 
-
-  if(alloc != NULL) {
-    // Bin search was successful
-    int page = page_number((long)alloc, (long)entrypage);
-    page_header_t* current = (page_header_t*)((long)entrypage_header + (page * PAGESIZE));
+  kma_page_t* page;
+  buffer_t* buf;
+  int class;
+  
+  // a space larger than half a page gets contiguous pages of its own
+  if (size > MAXBUF)
+    {
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      page->sclass = LARGE;
+      return page->ptr;
+    }
+  
+  class = size_class(size);
+  page = g_partial[class];
+  if (page == NULL)
+    {
+      page = init_page(class);
+    }
+  
+  buf = (buffer_t*) page->freelist;
+  page->freelist = buf->next;
+  page->nfree--;
+  if (page->nfree == 0)
+    {
+      // a full page leaves the list until a buffer comes back
+      unlink_page(page);
+    }
+  
+  return buf;
+}
+
+void*
+kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  void* ptr;
   
-    // Increment Allocations
-    current->num_alloc++;
-    entrypage_header->header.num_alloc++;
-    alloc_remove(alloc);
-    return alloc;
-  } else {
-    // Bin search was unsuccessful 
-    alloc = search_pages(size);
-    if(alloc != NULL) {
-      // search page successful
-      int page = page_number((long)alloc, (long)entrypage_header); 
-      page_header_t* current = (page_header_t*)((long)entrypage_header + (page * PAGESIZE));
-
-      // Increment allocations
-      current->num_alloc++;
-      entrypage_header->header.num_alloc++;
-
-      current->nextblock = (void*)((long)current->next+block + alloc_size);
+  if (size != 0 && nmemb > INT_MAX / size)
+    {
+      return NULL;
+    }
+  
+  // a large space gets pages that are zero already
+  if (nmemb * size > MAXBUF)
+    {
+      kma_page_t* page = get_zeroed_pages((nmemb * size + PAGESIZE - 1) / PAGESIZE);
       
-  }
+      page->sclass = LARGE;
+      return page->ptr;
+    }
+  
+  ptr = kma_malloc(nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  
+  return ptr;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  kma_page_t* page = page_of(ptr);
+  buffer_t* buf = (buffer_t*) ptr;
+  
+  if (page->sclass == LARGE)
+    {
+      free_pages(page);
+      return;
+    }
+  
+  buf->next = (buffer_t*) page->freelist;
+  page->freelist = buf;
+  page->nfree++;
+  
+  if (page->nfree == page->inuse)
+    {
+      // every buffer of the page is free: return the page
+      if (page->nfree > 1)
+	{
+	  unlink_page(page);
+	}
+      free_page(page);
+    }
+  else if (page->nfree == 1)
+    {
+      link_page(page);
+    }
+}
+
+int
+size_class(kma_size_t size)
+{
+  if (size <= MINBUF)
+    {
+      return 0;
+    }
+  
+  return (8 * sizeof(int) - __builtin_clz(size - 1)) - MINSHIFT;
+}
+
+kma_page_t*
+init_page(int class)
+{
+  kma_page_t* page = get_page();
+  int size = MINBUF << class;
+  int i;
+  
+  // carve the page into buffers; inuse holds the number of buffers
+  page->sclass = class;
+  page->inuse = PAGESIZE / size;
+  page->nfree = page->inuse;
+  page->freelist = NULL;
+  for (i = page->inuse - 1; i >= 0; i--)
+    {
+      buffer_t* buf = (buffer_t*) (page->ptr + i * size);
+      
+      buf->next = (buffer_t*) page->freelist;
+      page->freelist = buf;
+    }
+  
+  link_page(page);
+  
+  return page;
+}
+
+void
+link_page(kma_page_t* page)
+{
+  page->prev = NULL;
+  page->next = g_partial[page->sclass];
+  if (page->next != NULL)
+    {
+      page->next->prev = page;
+    }
+  g_partial[page->sclass] = page;
+}
+
+void
+unlink_page(kma_page_t* page)
+{
+  if (page->prev != NULL)
+    {
+      page->prev->next = page->next;
+    }
+  else
+    {
+      g_partial[page->sclass] = page->next;
+    }
+  if (page->next != NULL)
+    {
+      page->next->prev = page->prev;
+    }
 }
 
 #endif // KMA_MCK2
@@ -37,8 +37,10 @@
 
 /************System include***********************************************/
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
@@ -50,49 +52,64 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-// struct used as the header of each buffer
+// most pages a free list takes (or gives back) in one page layer call
+#define BATCHPAGES 4
+// most pages in one run of buffers
+#define MAXRUNPAGES 4
+// a list takes single pages until it holds this many, and runs after
+#define WARMPAGES 8
+// a single page is enough when at most this share of it is left over
+#define TAILWASTE 32
+
+// the size classes: steps of 16 bytes up to 128, then four classes
+// per power of two (quarter powers) up to a page
+#define SIZE_CLASSES(X)						\
+  X(16) X(32) X(48) X(64) X(80) X(96) X(112) X(128)		\
+  X(160) X(192) X(224) X(256) X(320) X(384) X(448) X(512)	\
+  X(640) X(768) X(896) X(1024) X(1280) X(1536) X(1792) X(2048)	\
+  X(2560) X(3072) X(3584) X(4096) X(5120) X(6144) X(7168) X(8192)
+
+#define SMALLCLASSES 8
+#define SMALLSHIFT 4
+
+#define CLASS_COUNT(size) + 1
+#define NCLASSES (0 SIZE_CLASSES(CLASS_COUNT))
+
+// struct used as the link of each free buffer; buffers in use have no
+// header, the free list they belong to is the owner of their page
 typedef struct
 {
    void* nextblock;
 } buffer_header;
 
-// struct to keep track of pages allocated to a certain free list
-typedef struct page_node_struct
-{
-   kma_page_t* page;
-   struct page_node_struct* next;
-} page_node;
-
 // struct used as the header to a free list
 typedef struct
 {
   int size; // size of buffers in this free list
+  int pages; // pages in each run of buffers, once the list is warm
   int used; // number of blocks used
   buffer_header* start; // pointer to the first buffer in the linked list
-  page_node* page_list;
+  kma_page_t* page_list; // runs given to this free list, linked through next
+  int npages; // number of runs in page_list
 } free_list;
 
 typedef struct
 {
-  free_list buffer_32;
-  free_list buffer_64;
-  free_list buffer_128;
-  free_list buffer_256;
-  free_list buffer_512;
-  free_list buffer_1024;
-  free_list buffer_2048;
-  free_list buffer_4096;
-  free_list buffer_8192;
+  free_list lists[NCLASSES];
   int used;
-  free_list kpages;
 } main_list;
 /************Global Variables*********************************************/
-kma_page_t* entry_point;
+main_list* entry_point;
+static main_list g_mainlist;
+#define CLASS_SIZE(size) size,
+static const int k_class_size[NCLASSES] = { SIZE_CLASSES(CLASS_SIZE) };
 /************Function Prototypes******************************************/
 
 void* kma_malloc(kma_size_t size);
 void kma_free(void* ptr, kma_size_t size);
-void initialize_page(kma_page_t* page_ptr);
+void initialize_lists(main_list* mainlist);
+int size_class(kma_size_t size);
+int run_pages(int size);
 void* find_buffer_from_free_list(free_list* list);
 void allocate_buffers_to_list(free_list* list);
 /************External Declaration*****************************************/
@@ -102,49 +119,52 @@ void allocate_buffers_to_list(free_list* list);
 void*
 kma_malloc(kma_size_t size)
 {
-  // cannot allocate a space larger than a page
- // if (size > PAGESIZE) {
-//	return NULL;
-  //}
+  // a space larger than a page gets contiguous pages of its own
+  if (size > PAGESIZE) {
+	kma_page_t* run = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+	return run->ptr;
+  }
 
   if (entry_point == NULL) {
-	// no page allocated yet, need to allocate first page
-	entry_point = get_page();
-	initialize_page(entry_point);
+	// the free lists have not been set up yet
+	entry_point = &g_mainlist;
+	initialize_lists(entry_point);
   }
 
-  main_list* mainlist = (main_list*)entry_point->ptr;
-  int total_space = size + sizeof(buffer_header);
-  free_list* target = NULL;
-
-  // find the right free list
-  if (total_space <= 32) {
-	target = &mainlist->buffer_32;
-  } else if (total_space <= 64) {
-	target = &mainlist->buffer_64;
-  } else if (total_space <= 128) {
-	target = &mainlist->buffer_128;
-  } else if (total_space <= 256) {
-	target = &mainlist->buffer_256;
-  } else if (total_space <= 512) {
-	target = &mainlist->buffer_512;
-  } else if (total_space <= 1024) {
-	target = &mainlist->buffer_1024;
-  } else if (total_space <= 2048) {
-	target = &mainlist->buffer_2048;
-  } else if (total_space <= 4096) {
-	target = &mainlist->buffer_4096;
-  } else if (total_space <= 8192) {
-	target = &mainlist->buffer_8192;
+  return find_buffer_from_free_list(&entry_point->lists[size_class(size)]);
+}
+
+int
+size_class(kma_size_t size)
+{
+  // steps of 16 bytes, then four classes per power of two: the
+  // highest bit of size - 1 picks the power, the two below it the
+  // quarter
+  if (size <= SMALLCLASSES << SMALLSHIFT) {
+	return size <= 1 << SMALLSHIFT ? 0 : (size - 1) >> SMALLSHIFT;
   }
+  int bit = 31 - __builtin_clz(size - 1);
+  return SMALLCLASSES + ((bit - 7) << 2) + (((size - 1) >> (bit - 2)) & 3);
+}
 
-  // if target was not found in the mainlist, give it a buffer
-  if (target != NULL) {
-	void* mem_pointer = find_buffer_from_free_list(target);
-	return mem_pointer;
-  } else {
-	return NULL;
-  } 
+int
+run_pages(int size)
+{
+  // a page that leaves at most TAILWASTE of itself unused will do;
+  // otherwise the run of at most MAXRUNPAGES pages that leaves the
+  // smallest share of it unused, the shortest of those
+  int best = 1;
+  int pages;
+  if (PAGESIZE % size <= PAGESIZE / TAILWASTE) {
+	return 1;
+  }
+  for (pages = 2; pages <= MAXRUNPAGES; pages++) {
+	if ((pages * PAGESIZE) % size * best
+	    < (best * PAGESIZE) % size * pages) {
+		best = pages;
+	}
+  }
+  return best;
 }
 
 void*
@@ -160,16 +180,11 @@ find_buffer_from_free_list(free_list* list)
   buffer_header* buf = list->start;
   // set the start of the list to point to the next free block
   list->start = (buffer_header*)buf->nextblock;
-  // set the next pointer of the now removed buffer to point back at the list
-  buf->nextblock = (void*)list;
   // increment the used count of list
   list->used++;
-  main_list* temp = (main_list*)entry_point->ptr;
-  if (list != &temp->kpages) {
-	temp->used++;
-  }
-  // return a pointer to the free space in the buffer
-  return (void*)buf + sizeof(buffer_header);
+  entry_point->used++;
+  // the buffer is handed out without a header
+  return (void*)buf;
 }
 
 void
@@ -178,42 +193,96 @@ allocate_buffers_to_list(free_list* list)
   // need to allocate more space
   // find what size the buffers need to be
   int size = list->size;
-  // allocate a new page to this free list
-  kma_page_t* new_page = get_page();
-  // find the number of buffers we can get from the new page
-  int divisions = PAGESIZE / size;
-  // grab the start pointer of the new page
-  void* page_start = new_page->ptr;
-  int i;
-  // make a free list of buffers of size 
-  for (i = 0; i < divisions; i++)
+  kma_page_t* new_pages[BATCHPAGES];
+  int count = 1;
+  if (list->pages > 1 && list->npages >= WARMPAGES) {
+	// a run of several pages, so the buffers fill it with little left
+	// over; a list that may never need more than a page or two does
+	// not get one
+	new_pages[0] = get_pages(list->pages);
+  } else {
+	// a list that already needed many pages is likely to need more, so
+	// it grows by a batch; a fresh list takes a single page
+	count = 1 + list->npages / 8;
+	if (count > BATCHPAGES) {
+		count = BATCHPAGES;
+	}
+	// pages this list set aside when it last ran empty come back first
+	int reclaimed = 0;
+	while (reclaimed < count
+	       && (new_pages[reclaimed] = reclaim_page(list)) != NULL) {
+		reclaimed++;
+	}
+	if (reclaimed < count) {
+		get_pages_bulk(new_pages + reclaimed, count - reclaimed);
+	}
+  }
+  int i, j;
+  for (j = 0; j < count; j++)
   {
-	// create a new buffer
-	buffer_header* buf = (buffer_header*)(page_start + i * size);
-	// set the nextblock to point to the buf pointed to by list->start
-	buf->nextblock = list->start;
-	// set the start to the most recently created buf
-	list->start = buf;
+	kma_page_t* new_page = new_pages[j];
+	// find the number of buffers we can get from this run
+	int divisions = new_page->size / size;
+	// grab the start pointer of the new page
+	void* page_start = new_page->ptr;
+	// make a free list of buffers of size
+	for (i = 0; i < divisions; i++)
+	{
+	  // create a new buffer
+	  buffer_header* buf = (buffer_header*)(page_start + i * size);
+	  // set the nextblock to point to the buf pointed to by list->start
+	  buf->nextblock = list->start;
+	  // set the start to the most recently created buf
+	  list->start = buf;
+	}
+
+	// every page of the run remembers its free list, so kma_free can
+	// find it
+	for (i = 0; i < new_page->size / PAGESIZE; i++)
+	{
+	  page_of(page_start + i * PAGESIZE)->owner = list;
+	}
+	// add the page to the linked list of pages in order to keep track of it
+	new_page->next = list->page_list;
+	list->page_list = new_page;
+  }
+  list->npages += count;
+}
+
+void*
+kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  if (size != 0 && nmemb > INT_MAX / size) {
+	return NULL;
   }
-  
-  // add page to free list of pages in order to keep track of it
-  main_list* temp = (main_list*)entry_point->ptr;
-  page_node* p_node = (page_node*)find_buffer_from_free_list(&(temp->kpages));
-  p_node->page = new_page;
-  // add p_node to the linked list of pages 
-  p_node->next = list->page_list;
-  list->page_list = p_node;
+  size *= nmemb;
 
+  // a large space gets pages that are zero already
+  if (size > PAGESIZE) {
+	kma_page_t* run = get_zeroed_pages((size + PAGESIZE - 1) / PAGESIZE);
+	return run->ptr;
+  }
+
+  // buffers are recycled through the free lists, so they are cleared
+  void* ptr = kma_malloc(size);
+  memset(ptr, 0, size);
+  return ptr;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  // get to the beginning of the block by subtracting the size of the buffer_header from the pointer passed in
-  buffer_header* buf = (buffer_header*)((void*)ptr - sizeof(buffer_header));
-  // return the buffer to the free list we first removed it from
-  // when we removed it, we set the next pointer to point to the list it originally came from
-  free_list* list = (free_list*)buf->nextblock;
+  kma_page_t* page = page_of(ptr);
+
+  if (page->owner == NULL) {
+	// large space: release the pages it was given
+	free_pages(page);
+	return;
+  }
+
+  buffer_header* buf = (buffer_header*)ptr;
+  // return the buffer to the free list that owns its page
+  free_list* list = (free_list*)page->owner;
   // adding it back to the linked list
   buf->nextblock = list->start;
   list->start = buf;
@@ -221,106 +290,69 @@ kma_free(void* ptr, kma_size_t size)
 
   if (list->used == 0) {
 	list->start = NULL;
-	// start from the top, traverse the linked list of pages and free them
-	// this is done when a certain free list is empty
-	page_node* temp = list->page_list;
+	// start from the top, traverse the linked list of pages and hand them
+	// back a batch at a time; this is done when a certain free list is
+	// empty. The page layer retains them for a while, since a list that
+	// ran empty is often refilled soon after
+	kma_page_t* batch[BATCHPAGES];
+	kma_page_t* runs[BATCHPAGES];
+	int count = 0, nruns = 0;
+	kma_page_t* temp = list->page_list;
 	while (temp != NULL) {
-		free_page(temp->page);
-		temp = temp->next;
+		kma_page_t* next = temp->next;
+		if (temp->size > PAGESIZE) {
+			// runs are not retained, only freed
+			runs[nruns++] = temp;
+			if (nruns == BATCHPAGES) {
+				free_pages_bulk(runs, nruns);
+				nruns = 0;
+			}
+		} else {
+			batch[count++] = temp;
+			if (count == BATCHPAGES) {
+				retain_pages(batch, count);
+				count = 0;
+			}
+		}
+		temp = next;
+	}
+	if (nruns > 0) {
+		free_pages_bulk(runs, nruns);
+	}
+	if (count > 0) {
+		retain_pages(batch, count);
 	}
 	// all buffers of this free list have been freed
 	list->page_list = NULL;
+	list->npages = 0;
   }
 
   // decrease the count from the main list too
-  main_list* temp_main_list = (main_list*)entry_point->ptr;
-  temp_main_list->used--;
-  // if the main list is empty, we should free the pages that are used to hold the page_nodes
-  if (temp_main_list->used == 0) {
-	page_node* temp_page_node = temp_main_list->kpages.page_list;
-	while (temp_page_node->next != NULL) {
-		free_page(temp_page_node->page);
-		temp_page_node = temp_page_node->next;
-	}
-	free_page(temp_page_node->page);
+  entry_point->used--;
+  // if the main list is empty, it has to be set up again on the next request
+  if (entry_point->used == 0) {
 	entry_point = NULL;
   }
 }
 
 void
-initialize_page(kma_page_t* page_ptr)
+initialize_lists(main_list* mainlist)
 {
-  // initialize the page if it hasn't been initialized before.
+  // initialize the free lists if they haven't been initialized before.
   // This involves setting the main fields of each struct.
-
-  kma_page_t* current_page = page_ptr; 
-  main_list* current_main_list = (main_list*)current_page->ptr;
   int i;
-	
-	current_main_list->buffer_32.size = 32;
-	current_main_list->buffer_64.size = 64;
-	current_main_list->buffer_128.size = 128;
-	current_main_list->buffer_256.size = 256;
-	current_main_list->buffer_512.size = 512;
-	current_main_list->buffer_1024.size = 1024;
-	current_main_list->buffer_2048.size = 2048;
-	current_main_list->buffer_4096.size = 4096;
-	current_main_list->buffer_8192.size = 8192; 
-	current_main_list->kpages.size = sizeof(page_node) + sizeof(buffer_header);
-
-	current_main_list->buffer_32.used = 0;
-	current_main_list->buffer_64.used = 0;
-	current_main_list->buffer_128.used = 0;
-	current_main_list->buffer_256.used = 0;
-	current_main_list->buffer_512.used = 0;
-	current_main_list->buffer_1024.used = 0;
-	current_main_list->buffer_2048.used = 0;
-	current_main_list->buffer_4096.used = 0;
-	current_main_list->buffer_8192.used = 0;
-	current_main_list->kpages.used = 0;
-
-	current_main_list->buffer_32.page_list = NULL;
-	current_main_list->buffer_64.page_list = NULL;
-	current_main_list->buffer_128.page_list = NULL;
-	current_main_list->buffer_256.page_list = NULL;
-	current_main_list->buffer_512.page_list = NULL;
-	current_main_list->buffer_1024.page_list = NULL;
-	current_main_list->buffer_2048.page_list = NULL;
-	current_main_list->buffer_4096.page_list = NULL;
-	current_main_list->buffer_8192.page_list = NULL;
-	current_main_list->kpages.page_list = NULL;
-
-	current_main_list->buffer_32.start = NULL;
-	current_main_list->buffer_64.start = NULL;
-	current_main_list->buffer_128.start = NULL;
-	current_main_list->buffer_256.start = NULL;
-	current_main_list->buffer_512.start = NULL;
-	current_main_list->buffer_1024.start = NULL;
-	current_main_list->buffer_2048.start = NULL;
-	current_main_list->buffer_4096.start = NULL;
-	current_main_list->buffer_8192.start = NULL; 
-	current_main_list->kpages.start = NULL;
-
-
-	// divide the remaining space into buffers that hold page_nodes
-	// the first page is used to hold the main list and the page_nodes
-	int remaining_space = PAGESIZE - sizeof(main_list);
-	void* start_point = current_page->ptr + sizeof(main_list);
-	int count = remaining_space / (sizeof(page_node) + sizeof(buffer_header));
-	buffer_header* buf;
-	
-	for (i = 0; i < count; i++) {
-		buf = (buffer_header*)(start_point + i * (sizeof(page_node) + sizeof(buffer_header)));
-		buf->nextblock = current_main_list->kpages.start;
-		current_main_list->kpages.start = buf;
-	}
+  for (i = 0; i < NCLASSES; i++)
+  {
+	free_list* list = &mainlist->lists[i];
+	list->size = k_class_size[i];
+	list->pages = run_pages(list->size);
+	list->used = 0;
+	list->start = NULL;
+	list->page_list = NULL;
+	list->npages = 0;
+  }
 
-	main_list* temp = (main_list*)entry_point->ptr;
-	page_node* p_node = (page_node*)find_buffer_from_free_list(&temp->kpages);
-	p_node->page = current_page;
-	p_node->next = current_main_list->kpages.page_list;
-	current_main_list->kpages.page_list = p_node;
-	
+  mainlist->used = 0;
 }
 
 #endif // KMA_P2FL
@@ -36,8 +36,10 @@
 
 /************System include***********************************************/
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -51,34 +53,123 @@
  */
 
 /*** pair_t *****/
-/* Used to keep the pair <base, size> resource map entries. Has a linked list form */
-typedef struct
+/* Used to keep the pair <base, size> resource map entries. Every block, free or
+ * handed out, starts with a boundary tag holding its size and whether it and the
+ * block before it are free; a free block also ends with its size, so a freed block
+ * finds its free neighbours in O(1). The free blocks of a page are in a linked list
+ * of their own. */
+typedef struct pair
 {
-  int size;
-  void * nextblock;
-  void * prevblock;
+  long int tag;
+  struct pair * nextblock;
+  struct pair * prevblock;
 } pair_t; 
 /****************/
-/*** page_info_t ***/
-/* Contains necessary information about the page. Makes life easier when freeing & coalescing pages. */
-typedef struct
+
+/*** rmpage_t ***/
+/* Sits at the start of every page of the map. Keeps the page's free blocks and the
+ * size of the largest one. The pages with free blocks are the nodes of a red-black
+ * tree, the page directory, ordered by that size (and by address between equal
+ * sizes), so the page with the best fitting largest block is found in O(log n) and
+ * full pages are never looked at. The pages are also in a ring in the order they
+ * joined the map, for the policies that walk them. */
+typedef struct rmpage
 {
-  int buffer_count;
-  int page_count;
+  int largest;
+  int red;
   pair_t * entry;
-  void * page;
-} page_info_t;
-/**************/
+  struct rmpage * left;
+  struct rmpage * right;
+  struct rmpage * parent;
+  struct rmpage * nextpage;
+  struct rmpage * prevpage;
+} rmpage_t;
+/****************/
+/* Pages of the map have the map as the owner in their kma_page_t. Each page ends
+ * with a tag of size 0 that is never free. A page is handed back to kma_page as
+ * soon as it is empty, whatever its place; kma_page keeps a few of them aside for
+ * the map, still set up, until they decay. */
+
+/* Placement policies. The build picks the default with -DRMPOLICY=..., and the
+ * KMA_RM_POLICY environment variable (first, next, best, worst or good) overrides
+ * it. First fit and next fit walk the ring of pages (next fit from the page last
+ * used) and take the first block that fits; best fit takes the page with the
+ * smallest largest block that fits from the directory and the best block in it;
+ * worst fit takes the largest block of the map; good fit picks the page like best
+ * fit but stops after GOODFIT blocks that fit (KMA_RM_GOODFIT overrides it). */
+#define FIRSTFIT 0
+#define NEXTFIT 1
+#define BESTFIT 2
+#define WORSTFIT 3
+#define GOODFIT_POLICY 4
+
+#ifndef RMPOLICY
+#define RMPOLICY BESTFIT
+#endif
+#ifndef GOODFIT
+#define GOODFIT 4
+#endif
+
+/* Deferred coalescing. With -DRMDEFER (or KMA_RM_DEFER=1; KMA_RM_DEFER=0 turns it
+ * off) kma_free only queues the block, still marked in use. kma_malloc first
+ * reuses a queued block that fits without a split, and otherwise merges at most
+ * DEFERBATCH of the oldest queued blocks into the map; it merges the whole queue
+ * at once only when the map has no block for it. A free into a full queue (of
+ * DEFERQUEUE blocks) merges DEFERBATCH blocks to make room, and the queue is merged
+ * at once when nothing is in use any more, so the pages go back. */
+#define DEFERQUEUE 8
+#define DEFERBATCH 1
+
+#define FREE 1 // The block is free
+#define PREVFREE 2 // The block before it is free
+#define SIZEMASK (~7L)
+#define ALIGN 8
+
+#define TAGSIZE sizeof(long int)
+#define MINBLOCK (sizeof(pair_t) + TAGSIZE) // Room for the pair and the size at its end
+#define PAGESPACE (PAGESIZE - sizeof(rmpage_t) - TAGSIZE) // Between the header and the closing tag
+#define MAXSPACE (PAGESPACE - TAGSIZE) // The most kma_malloc takes from the map
+
+#define SIZE(p) ((p)->tag & SIZEMASK)
+#define NEXTBLOCK(p) ((pair_t*)((long int)(p) + SIZE(p)))
+#define FOOTER(p) (*(long int*)((long int)(p) + SIZE(p) - TAGSIZE))
+#define PAGEOF(p) ((rmpage_t*)BASEADDR(p))
 
 /************Global Variables*********************************************/
-kma_page_t * g_rmap = NULL;
+rmpage_t * g_root = NULL; // Root of the page directory
+rmpage_t * g_pages = NULL; // First page of the ring
+rmpage_t * g_rover = NULL; // Page next fit starts from
+int g_policy = -1; // Placement policy, read on first use
+int g_goodfit = GOODFIT; // Blocks good fit looks at
+int g_defer = -1; // Deferred coalescing, read on first use
+pair_t * g_pending[DEFERQUEUE]; // Ring of blocks freed but not merged yet
+int g_head = 0; // Oldest queued block
+int g_npending = 0; // Queued blocks
+int g_live = 0; // Blocks in use, not counting the queued ones
 
 /************Function Prototypes******************************************/
-void new_page();
+rmpage_t * new_page();
 void * find_space(kma_size_t size);
+int policy();
+rmpage_t * find_page(kma_size_t size);
+pair_t * find_block(rmpage_t * page, kma_size_t size);
+int deferring();
+pair_t * reuse_pending(kma_size_t size);
+void merge_pending(int n);
 void add_pair(void * base, kma_size_t size);
 void delete_pair(void * base);
+void set_largest(rmpage_t * page, int largest);
+void link_page(rmpage_t * page);
+void unlink_page(rmpage_t * page);
 void coalesce(void * ptr);
+int page_less(rmpage_t * a, rmpage_t * b);
+rmpage_t * tree_fit(kma_size_t size);
+void tree_insert(rmpage_t * node);
+void tree_delete(rmpage_t * node);
+void tree_fixup(rmpage_t * x, rmpage_t * parent);
+void transplant(rmpage_t * u, rmpage_t * v);
+void rotate_left(rmpage_t * x);
+void rotate_right(rmpage_t * x);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -90,26 +181,56 @@ void coalesce(void * ptr);
 ****************************************************************************/
 void* kma_malloc(kma_size_t size)
 {
-  if((size + sizeof(kma_page_t*)) > PAGESIZE)
+  if(size > MAXSPACE) // Too large for the map: give it pages of its own
   {
-    return NULL;
+    kma_page_t* run = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+    return run->ptr;
   }
   
-  if(size < sizeof(kma_page_t)) 
+  size = (size + TAGSIZE + ALIGN - 1) & SIZEMASK; // Room for the tag in front
+  if(size < MINBLOCK) 
   {
-    size = sizeof(kma_page_t);
+    size = MINBLOCK;
   }
 
-  if (g_rmap == NULL) { // CREATE NEW PAGE IF THERE IS NO PAGE YET
-    g_rmap = get_page();
-    
-    new_page(g_rmap);
-
+  pair_t * ret = NULL;
+  if(deferring())
+  {
+    g_live++;
+    ret = reuse_pending(size); // A queued block that fits as it is
+    if(ret == NULL)
+    {
+      merge_pending(DEFERBATCH);
+    }
   }
+  if(ret == NULL)
+  {
+    ret = find_space(size); // Find the return space
+  }
+  return ((void*)((long int)ret + TAGSIZE));
+}
 
-  void * ret = find_space(size); // Find the return space
-  page_info_t * basepage = BASEADDR(ret); 
-  basepage->buffer_count++;
+/****************************************************************************
+ * Name: kma_calloc
+ * Purpose: kernel memory allocator (calloc)
+ * Description: Returns pointer to a zeroed block of memory upon request
+****************************************************************************/
+void* kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  if(size != 0 && nmemb > INT_MAX / size) // Would overflow
+  {
+    return NULL;
+  }
+  size *= nmemb;
+  
+  if(size > MAXSPACE) // Pages of its own, zero already
+  {
+    kma_page_t* run = get_zeroed_pages((size + PAGESIZE - 1) / PAGESIZE);
+    return run->ptr;
+  }
+  
+  void * ret = kma_malloc(size); // Space from the map has been used before
+  memset(ret, 0, size);
   return ret;
 }
 
@@ -121,97 +242,372 @@ void* kma_malloc(kma_size_t size)
  **************************************************************************/
 void kma_free(void* ptr, kma_size_t size)
 {
-  add_pair(ptr, size); // New pair of free memory
-  coalesce(ptr); // Coalesce the memory space
+  if(size > MAXSPACE) // Large block: release its pages
+  {
+    free_pages(page_of(ptr));
+    return;
+  }
+
+  pair_t * block = (pair_t*)((long int)ptr - TAGSIZE); // The tag knows the size
+  if(deferring())
+  {
+    if(g_npending == DEFERQUEUE) // Make room
+    {
+      merge_pending(DEFERBATCH);
+    }
+    g_pending[(g_head + g_npending) % DEFERQUEUE] = block;
+    g_npending++;
+    g_live--;
+    if(g_live == 0) // Nothing in use: let the pages go
+    {
+      merge_pending(g_npending);
+    }
+    return;
+  }
+  add_pair(block, SIZE(block)); // New pair of free memory, merged with its neighbours
+  coalesce(block); // Release the page if it is empty now
 }
 
 /***************************************************************************
  * Name: new_page
- * Input: kma_page_t * pointer_to_new_page
- * Output: none
- * Purpose: Set up a new page
+ * Input: none
+ * Output: The header of a page with one free block over it
+ * Purpose: Add a page to the map
  **************************************************************************/
-void new_page(kma_page_t* page)
+rmpage_t * new_page()
 {
-  *((kma_page_t**)page->ptr) = page; 
-  page_info_t * pageinfo = (page_info_t *)(page->ptr);
-  pageinfo->page_count = 0;
-  pageinfo->buffer_count = 0;
-  pageinfo->entry = (pair_t*)((long int)pageinfo + sizeof(page_info_t));
-  pageinfo->page = page;
-  add_pair((void*)(pageinfo->entry), (PAGESIZE-sizeof(page_info_t)));
+  kma_page_t * page = reclaim_page(&g_root);
+  rmpage_t * header;
+  
+  if(page != NULL) // Left as it was when it was empty: put it back in the directory
+  {
+    header = (rmpage_t*)(page->ptr);
+    tree_insert(header);
+    link_page(header);
+    return header;
+  }
+  
+  page = get_page();
+  page->owner = &g_root; // The page belongs to the map
+  header = (rmpage_t*)(page->ptr);
+  pair_t * block = (pair_t*)(header + 1);
+  
+  header->largest = 0; // Not in the directory until it has a free block
+  header->entry = NULL;
+  link_page(header);
+  block->tag = PAGESPACE; // One block over the page, nothing free before it
+  NEXTBLOCK(block)->tag = 0; // Closing tag
+  add_pair(block, PAGESPACE);
+  return header;
 }
 
 /***************************************************************************
  * Name: find_space
- * Input: kma_size_t size
- * Output: Pointer to the allocated space
+ * Input: kma_size_t size of the block, tag included
+ * Output: Pointer to the allocated block
  * Purpose: Find appropriate space and return the pointer to the space
  **************************************************************************/
 void* find_space(kma_size_t size)
 {
-  page_info_t * pageinfo = (page_info_t*)(g_rmap->ptr);
-  pair_t * npair = (pair_t*)(pageinfo->entry); 
-  while(npair != NULL)
+  rmpage_t * page = find_page(size);
+  if(page == NULL && g_npending > 0) // The queued blocks may merge into one that fits
+  {
+    merge_pending(g_npending);
+    page = find_page(size);
+  }
+  if(page == NULL) // No more space left in the map: Get a new page
+  {
+    page = new_page();
+  }
+  g_rover = page;
+
+  pair_t * npair = find_block(page, size);
+  pair_t * temp;
+  int largest = SIZE(npair) == page->largest;
+  delete_pair(npair);
+  if (SIZE(npair) - size < MINBLOCK) // Perfect fit: the tag keeps the real size
+  {
+    NEXTBLOCK(npair)->tag &= ~PREVFREE;
+  } else { // Split: the rest stays in the map
+    pair_t * rest = (pair_t*)((long int)npair + size);
+    rest->tag = SIZE(npair) - size;
+    npair->tag = size;
+    add_pair(rest, SIZE(rest));
+  }
+
+  if(largest) // The largest block of the page is gone: look for the next one
+  {
+    int max = 0;
+    for(temp = page->entry; temp != NULL; temp = temp->nextblock)
+    {
+      if(SIZE(temp) > max)
+        max = SIZE(temp);
+    }
+    set_largest(page, max);
+  }
+  return ((void*)npair);
+}
+
+/***************************************************************************
+ * Name: policy
+ * Input: None
+ * Output: The placement policy
+ * Purpose: Read the policy from the environment the first time, or use the build's
+ **************************************************************************/
+int policy()
+{
+  if(g_policy < 0)
+  {
+    char * env = getenv("KMA_RM_POLICY");
+    g_policy = RMPOLICY;
+    if(env != NULL) // Names in the order of the policies
+    {
+      char * names[] = {"first", "next", "best", "worst", "good"};
+      int i;
+      for(i = 0; i < 5; i++)
+      {
+        if(strcmp(env, names[i]) == 0)
+          g_policy = i;
+      }
+    }
+    env = getenv("KMA_RM_GOODFIT");
+    if(env != NULL && atoi(env) > 0)
+    {
+      g_goodfit = atoi(env);
+    }
+  }
+  return g_policy;
+}
+
+/***************************************************************************
+ * Name: find_page
+ * Input: kma_size_t size of the block, tag included
+ * Output: A page with a free block of at least size, or NULL
+ * Purpose: Pick the page to take the block from
+ **************************************************************************/
+rmpage_t * find_page(kma_size_t size)
+{
+  rmpage_t * page;
+  
+  switch(policy())
+  {
+  case FIRSTFIT: // Walk the ring from its start
+  case NEXTFIT: // Walk the ring from the page last used
+    page = (policy() == NEXTFIT && g_rover != NULL) ? g_rover : g_pages;
+    if(page == NULL)
+    {
+      return NULL;
+    }
+    rmpage_t * start = page;
+    do
+    {
+      if(page->largest >= size) // Full pages have no largest block
+        return page;
+      page = page->nextpage;
+    } while(page != start);
+    return NULL;
+  case WORSTFIT: // The page with the largest block of all
+    page = g_root;
+    while(page != NULL && page->right != NULL)
+    {
+      page = page->right;
+    }
+    return (page != NULL && page->largest >= size) ? page : NULL;
+  default: // The page with the smallest largest block that fits
+    return tree_fit(size);
+  }
+}
+
+/***************************************************************************
+ * Name: find_block
+ * Input: a page, kma_size_t size of the block, tag included
+ * Output: A free block of the page of at least size
+ * Purpose: Pick the block within the page
+ **************************************************************************/
+pair_t * find_block(rmpage_t * page, kma_size_t size)
+{
+  pair_t * npair = NULL;
+  pair_t * temp;
+  int seen = 0;
+  
+  for(temp = page->entry; temp != NULL; temp = temp->nextblock)
   {
-    if(npair->size < size) // Not enough space 
+    if(SIZE(temp) < size) // Not enough space
     {
-      npair = (pair_t*)(npair->nextblock);
       continue;
-    } else if (npair->size == size || npair->size - size < sizeof(pair_t)) // Perfect fit
+    }
+    if(policy() == FIRSTFIT || policy() == NEXTFIT)
     {
-      delete_pair(npair); 
-      return ((void*)npair);
-    } else {
-      add_pair((void*)((long int)npair + size), (npair->size - size)); 
-      delete_pair(npair); 
-      return ((void*)npair);
-    }  
-  }
-  // No more space left in the page: Get a new page
-  kma_page_t* newpage = get_page();
-  new_page(newpage);
-  pageinfo->page_count++;
-  return find_space(size); 
+      return temp;
+    }
+    if(policy() == WORSTFIT)
+    {
+      if(SIZE(temp) == page->largest)
+        return temp;
+      continue;
+    }
+    // Best fit, over the whole page or over the first blocks that fit
+    if(npair == NULL || SIZE(temp) < SIZE(npair))
+    {
+      npair = temp;
+      if(SIZE(npair) == size)
+        break;
+    }
+    if(policy() == GOODFIT_POLICY && ++seen == g_goodfit)
+    {
+      break;
+    }
+  }
+  return npair;
+}
+
+/***************************************************************************
+ * Name: deferring
+ * Input: None
+ * Output: 1 if frees are queued, 0 otherwise
+ * Purpose: Read the mode from the environment the first time, or use the build's
+ **************************************************************************/
+int deferring()
+{
+  if(g_defer < 0)
+  {
+    char * env = getenv("KMA_RM_DEFER");
+#ifdef RMDEFER
+    g_defer = (env == NULL || atoi(env) != 0);
+#else
+    g_defer = (env != NULL && atoi(env) != 0);
+#endif
+  }
+  return g_defer;
+}
+
+/***************************************************************************
+ * Name: reuse_pending
+ * Input: kma_size_t size of the block, tag included
+ * Output: A queued block that fits without a split, or NULL
+ * Purpose: Hand a freed block out again before it is merged
+ **************************************************************************/
+pair_t * reuse_pending(kma_size_t size)
+{
+  int i;
+  for(i = 0; i < g_npending; i++)
+  {
+    pair_t * block = g_pending[(g_head + i) % DEFERQUEUE];
+    if(SIZE(block) >= size && SIZE(block) - size < MINBLOCK)
+    {
+      // The oldest block fills the hole
+      g_pending[(g_head + i) % DEFERQUEUE] = g_pending[g_head];
+      g_head = (g_head + 1) % DEFERQUEUE;
+      g_npending--;
+      return block;
+    }
+  }
+  return NULL;
+}
+
+/***************************************************************************
+ * Name: merge_pending
+ * Input: the most blocks to merge
+ * Output: None
+ * Purpose: Merge the oldest queued blocks into the map
+ **************************************************************************/
+void merge_pending(int n)
+{
+  while(n-- > 0 && g_npending > 0)
+  {
+    pair_t * block = g_pending[g_head];
+    g_head = (g_head + 1) % DEFERQUEUE;
+    g_npending--;
+    add_pair(block, SIZE(block));
+    coalesce(block);
+  }
+}
+
+/***************************************************************************
+ * Name: link_page
+ * Input: a page of the map
+ * Output: None
+ * Purpose: Add the page at the end of the ring
+ **************************************************************************/
+void link_page(rmpage_t * page)
+{
+  if(g_pages == NULL)
+  {
+    page->nextpage = page;
+    page->prevpage = page;
+    g_pages = page;
+    return;
+  }
+  page->nextpage = g_pages;
+  page->prevpage = g_pages->prevpage;
+  g_pages->prevpage->nextpage = page;
+  g_pages->prevpage = page;
+}
+
+/***************************************************************************
+ * Name: unlink_page
+ * Input: a page of the map
+ * Output: None
+ * Purpose: Take the page out of the ring
+ **************************************************************************/
+void unlink_page(rmpage_t * page)
+{
+  if(page->nextpage == page) // The only page
+  {
+    g_pages = NULL;
+    g_rover = NULL;
+    return;
+  }
+  page->prevpage->nextpage = page->nextpage;
+  page->nextpage->prevpage = page->prevpage;
+  if(g_pages == page)
+  {
+    g_pages = page->nextpage;
+  }
+  if(g_rover == page)
+  {
+    g_rover = page->nextpage;
+  }
 }
 
 /***************************************************************************
  * Name: add_pair 
  * Input: pointer to base, kma_size_t size of block
  * Output: None
- * Purpose: Add a node to the linked list of the pair 
+ * Purpose: Add a free block to its page, merged with the free blocks around it
  ***************************************************************************/
 void add_pair(void * base, kma_size_t size) 
 {
-  page_info_t * pageinfo = (page_info_t*)(g_rmap->ptr);
-  void * entry = (pair_t*)(pageinfo->entry);
+  rmpage_t * page = PAGEOF(base);
+  pair_t * block = (pair_t*)base;
+  pair_t * next = (pair_t*)((long int)base + size);
   
-  ((pair_t*)base)->size = size;
-  ((pair_t*)base)->prevblock = NULL;
-  
-  if(base < entry) // CASE WHERE THE NEW BLOCK IS LESS THAN THE ENTRY TO LIST 
+  if(block->tag & PREVFREE) // The size at the end of the block before finds it
   {
-    ((pair_t*)entry)->prevblock = base; // Update the prev of what used to be first node
-    ((pair_t*)base)->nextblock = entry; // Update the next of new first node
-    pageinfo->entry = (pair_t*)base; // Update the linked list entry pointer in g_rmap
-  } else if (base == entry) // CASE WHERE PAGE IS COMPLETELY EMPTY (PROBABLY NEW PAGE)
+    block = (pair_t*)((long int)base - *(long int*)((long int)base - TAGSIZE));
+    delete_pair(block);
+    size += SIZE(block);
+  }
+  if(next->tag & FREE)
   {
-    ((pair_t*)base)->nextblock = NULL; 
-  } else  // ALL THE OTHER CASES
+    delete_pair(next);
+    size += SIZE(next);
+  }
+  
+  block->tag = size | FREE; // Nothing free before a free block
+  FOOTER(block) = size;
+  NEXTBLOCK(block)->tag |= PREVFREE;
+  
+  block->prevblock = NULL;
+  block->nextblock = page->entry;
+  if(page->entry != NULL)
   {
-    // Find where to put it in the linked list 
-    while(((pair_t*)entry)->nextblock != NULL && entry < base) // Loop till right address is found
-    {
-      entry = ((pair_t*)entry)->nextblock; 
-    }
-    void * entry_next = ((pair_t*)entry)->nextblock;
-    if(entry_next != NULL) // if the next block isn't null, set its prevblock as base
-    { 
-      ((pair_t*)entry_next)->prevblock = base; 
-    }
-    ((pair_t*)entry)->nextblock = base; // add the base into the linked list
-    ((pair_t*)base)->prevblock = entry;
-    ((pair_t*)base)->nextblock = entry_next;
+    page->entry->prevblock = block;
+  }
+  page->entry = block;
+  if(size > page->largest)
+  {
+    set_largest(page, size);
   }
 }
 
@@ -219,35 +615,41 @@ void add_pair(void * base, kma_size_t size)
  * Name: delete_pair
  * Input: pointer to the base that wants to be freed
  * Output: None
- * Purpose: Get rid of something from the free pairs linked list
+ * Purpose: Get rid of something from the free pairs of its page
  **************************************************************************/
 void delete_pair(void * base)
 {
-  void * ptr = (pair_t*)base;
-  void * ptr_prev = ((pair_t*)ptr)->prevblock;
-  void * ptr_next = ((pair_t*)ptr)->nextblock;
-  if(ptr_prev == NULL && ptr_next == NULL) // There's only one pair
-  {
-    page_info_t * pageinfo = (page_info_t*)(g_rmap->ptr);
-    pageinfo->entry = NULL;
-    g_rmap = NULL;
-    return;
-  } else if(ptr_next == NULL) // The node is last node in the list 
-  { 
-    ((pair_t*)ptr_prev)->nextblock = NULL;
-  } else if (ptr_prev == NULL) // The node is first node in the list 
-  { 
-    ((pair_t*)ptr_next)->prevblock = NULL;
-    page_info_t * pageinfo = (page_info_t*)(g_rmap->ptr);
-    pageinfo->entry = ptr_next; // Update the global entry into the list 
-    return;
-  } else  // The node is in between: typical linked list node removal 
+  pair_t * block = (pair_t*)base;
+  
+  if(block->prevblock != NULL)
   {
-    pair_t * temp1 = ((pair_t*)ptr)->prevblock;
-    pair_t * temp2 = ((pair_t*)ptr)->nextblock;
-    temp1->nextblock = temp2;
-    temp2->prevblock = temp1;
-    return;
+    block->prevblock->nextblock = block->nextblock;
+  } else {
+    PAGEOF(block)->entry = block->nextblock;
+  }
+  if(block->nextblock != NULL)
+  {
+    block->nextblock->prevblock = block->prevblock;
+  }
+  block->tag &= ~FREE; // The caller fixes the tag after it
+}
+
+/***************************************************************************
+ * Name: set_largest
+ * Input: a page of the map, the size of its largest free block
+ * Output: None
+ * Purpose: Move the page to its place in the directory; full pages leave it
+ **************************************************************************/
+void set_largest(rmpage_t * page, int largest)
+{
+  if(page->largest > 0)
+  {
+    tree_delete(page);
+  }
+  page->largest = largest;
+  if(largest > 0)
+  {
+    tree_insert(page);
   }
 }
 
@@ -255,46 +657,304 @@ void delete_pair(void * base)
  * Name: coalesce
  * Input: pointer to a memory block
  * Output: None
- * Purpose: Coalesce any memory space and free any pages that doesn't need to be there
+ * Purpose: Free the page of a block if it doesn't need to be there
  **************************************************************************/
 void coalesce(void * ptr)
 {
-  // Coalesce appropriate free memory blocks
-  // Also frees the page if necessary 
-  page_info_t* basepage = BASEADDR(ptr);
-  basepage->buffer_count--;
+  // Neighbours were merged by add_pair, so an empty page is a single free
+  // block over the whole page
+  rmpage_t * page = PAGEOF(ptr);
+  if(page->largest == PAGESPACE)
+  {
+    kma_page_t * kpage = page_of(page);
+    tree_delete(page); // Keeps its largest block for new_page
+    unlink_page(page);
+    retain_pages(&kpage, 1);
+  }
+}
+
+/***************************************************************************
+ * Name: page_less
+ * Input: two pages
+ * Output: 1 if a comes before b in the directory, 0 otherwise
+ * Purpose: Directory order: by largest free block, then by address
+ **************************************************************************/
+int page_less(rmpage_t * a, rmpage_t * b)
+{
+  return a->largest < b->largest || (a->largest == b->largest && a < b);
+}
+
+/***************************************************************************
+ * Name: tree_fit
+ * Input: kma_size_t size
+ * Output: The page with the smallest (then lowest) largest free block of at least
+ *         size, or NULL
+ * Purpose: Best fit search over the pages
+ **************************************************************************/
+rmpage_t * tree_fit(kma_size_t size)
+{
+  rmpage_t * node = g_root;
+  rmpage_t * best = NULL;
+
+  while(node != NULL)
+  {
+    if(node->largest >= size) // Fits: look for a smaller one on the left
+    {
+      best = node;
+      node = node->left;
+    } else {
+      node = node->right;
+    }
+  }
+  return best;
+}
+
+/***************************************************************************
+ * Name: tree_insert
+ * Input: pointer to a page with its largest block set
+ * Output: None
+ * Purpose: Add a page to the directory and restore the red-black properties
+ **************************************************************************/
+void tree_insert(rmpage_t * node)
+{
+  rmpage_t * parent = NULL;
+  rmpage_t ** link = &g_root;
 
-  page_info_t* firstpage = (page_info_t*)(g_rmap->ptr);
-  page_info_t* lastpage;
-  int end = firstpage->page_count;
-  int flag = 1;
+  while(*link != NULL)
+  {
+    parent = *link;
+    link = page_less(node, parent) ? &parent->left : &parent->right;
+  }
+  node->left = NULL;
+  node->right = NULL;
+  node->parent = parent;
+  node->red = 1;
+  *link = node;
 
-  while(flag)
+  // A red node must not have a red parent
+  while((parent = node->parent) != NULL && parent->red)
   {
-    lastpage = ((page_info_t*)((long int)firstpage + end * PAGESIZE));
-    flag = 0;
-    if(lastpage->buffer_count == 0)
+    rmpage_t * grand = parent->parent;
+    rmpage_t * uncle = (parent == grand->left) ? grand->right : grand->left;
+
+    if(uncle != NULL && uncle->red) // Recolor and move up
+    {
+      parent->red = 0;
+      uncle->red = 0;
+      grand->red = 1;
+      node = grand;
+      continue;
+    }
+    if(parent == grand->left)
     {
-      flag = 1;
-      pair_t * temp;
-      for(temp = firstpage->entry; temp != NULL; temp = temp->nextblock)
+      if(node == parent->right)
       {
-        if(BASEADDR(temp) == lastpage)
-          delete_pair(temp);
+        rotate_left(parent);
+        parent = node;
       }
-      flag = 1;
-      if(lastpage == firstpage)
+      rotate_right(grand);
+    } else {
+      if(node == parent->left)
       {
-        flag = 0;
-        g_rmap = NULL;
+        rotate_right(parent);
+        parent = node;
       }
-      free_page((kma_page_t*)(lastpage->page));
-      if(g_rmap != NULL)
-        firstpage->page_count--;
+      rotate_left(grand);
     }
-    end--;
+    parent->red = 0;
+    grand->red = 1;
+    break;
   }
+  g_root->red = 0;
 }
 
-#endif // KMA_RM
+/***************************************************************************
+ * Name: tree_delete
+ * Input: pointer to a page in the directory
+ * Output: None
+ * Purpose: Take a page out of the directory and restore the red-black properties
+ **************************************************************************/
+void tree_delete(rmpage_t * node)
+{
+  rmpage_t * x; // The node that moves into the place of the removed one
+  rmpage_t * parent;
+  int red = node->red;
+
+  if(node->left == NULL)
+  {
+    x = node->right;
+    parent = node->parent;
+    transplant(node, x);
+  } else if(node->right == NULL)
+  {
+    x = node->left;
+    parent = node->parent;
+    transplant(node, x);
+  } else {
+    rmpage_t * next = node->right; // Successor takes the place of the node
+    while(next->left != NULL)
+    {
+      next = next->left;
+    }
+    red = next->red;
+    x = next->right;
+    if(next->parent == node)
+    {
+      parent = next;
+    } else {
+      parent = next->parent;
+      transplant(next, x);
+      next->right = node->right;
+      next->right->parent = next;
+    }
+    transplant(node, next);
+    next->left = node->left;
+    next->left->parent = next;
+    next->red = node->red;
+  }
+
+  if(!red) // A black node is gone from one path
+  {
+    tree_fixup(x, parent);
+  }
+}
+
+/***************************************************************************
+ * Name: tree_fixup
+ * Input: the node (maybe NULL) that has one black too few, its parent
+ * Output: None
+ * Purpose: Restore the black height after a delete
+ **************************************************************************/
+void tree_fixup(rmpage_t * x, rmpage_t * parent)
+{
+  while(x != g_root && (x == NULL || !x->red))
+  {
+    if(x == parent->left)
+    {
+      rmpage_t * w = parent->right;
+      if(w->red)
+      {
+        w->red = 0;
+        parent->red = 1;
+        rotate_left(parent);
+        w = parent->right;
+      }
+      if((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red))
+      {
+        w->red = 1;
+        x = parent;
+        parent = x->parent;
+      } else {
+        if(w->right == NULL || !w->right->red)
+        {
+          w->left->red = 0;
+          w->red = 1;
+          rotate_right(w);
+          w = parent->right;
+        }
+        w->red = parent->red;
+        parent->red = 0;
+        w->right->red = 0;
+        rotate_left(parent);
+        x = g_root;
+      }
+    } else {
+      rmpage_t * w = parent->left;
+      if(w->red)
+      {
+        w->red = 0;
+        parent->red = 1;
+        rotate_right(parent);
+        w = parent->left;
+      }
+      if((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red))
+      {
+        w->red = 1;
+        x = parent;
+        parent = x->parent;
+      } else {
+        if(w->left == NULL || !w->left->red)
+        {
+          w->right->red = 0;
+          w->red = 1;
+          rotate_left(w);
+          w = parent->left;
+        }
+        w->red = parent->red;
+        parent->red = 0;
+        w->left->red = 0;
+        rotate_right(parent);
+        x = g_root;
+      }
+    }
+  }
+  if(x != NULL)
+  {
+    x->red = 0;
+  }
+}
+
+/***************************************************************************
+ * Name: transplant
+ * Input: a node in the tree, the subtree (maybe NULL) to put in its place
+ * Output: None
+ * Purpose: Hang v where u was
+ **************************************************************************/
+void transplant(rmpage_t * u, rmpage_t * v)
+{
+  if(u->parent == NULL)
+  {
+    g_root = v;
+  } else if(u == u->parent->left)
+  {
+    u->parent->left = v;
+  } else {
+    u->parent->right = v;
+  }
+  if(v != NULL)
+  {
+    v->parent = u->parent;
+  }
+}
+
+/***************************************************************************
+ * Name: rotate_left
+ * Input: a node with a right child
+ * Output: None
+ * Purpose: The right child takes the place of the node
+ **************************************************************************/
+void rotate_left(rmpage_t * x)
+{
+  rmpage_t * y = x->right;
 
+  x->right = y->left;
+  if(y->left != NULL)
+  {
+    y->left->parent = x;
+  }
+  transplant(x, y);
+  y->left = x;
+  x->parent = y;
+}
+
+/***************************************************************************
+ * Name: rotate_right
+ * Input: a node with a left child
+ * Output: None
+ * Purpose: The left child takes the place of the node
+ **************************************************************************/
+void rotate_right(rmpage_t * x)
+{
+  rmpage_t * y = x->left;
+
+  x->left = y->right;
+  if(y->right != NULL)
+  {
+    y->right->parent = x;
+  }
+  transplant(x, y);
+  y->right = x;
+  x->parent = y;
+}
+
+#endif // KMA_RM
@@ -0,0 +1,298 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on an SVR4-style resource
+ *             map kept as a sorted array
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.2  2009/10/31 21:28:52  jot836
+ *    This is the current version of KMA project 3.
+ *    It includes:
+ *    - the most up-to-date handout (F'09)
+ *    - updated skeleton including
+ *        file-driven test harness,
+ *        trace generator script,
+ *        support for evaluating efficiency of algorithm (wasted memory),
+ *        gnuplot support for plotting allocation and waste,
+ *        set of traces for all students to use (including a makefile and README of the settings),
+ *    - different version of the testsuite for use on the submission site, including:
+ *        scoreboard Python scripts, which posts the top 5 scores on the course webpage
+ *
+ *    Revision 1.1  2005/10/24 16:07:09  sbirrer
+ *    - skeleton
+ *
+ *    Revision 1.2  2004/11/05 15:45:56  sbirrer
+ *    - added size as a parameter to kma_free
+ *
+ *    Revision 1.1  2004/11/03 23:04:03  sbirrer
+ *    - initial version for the kernel memory allocator project
+ *
+ ***************************************************************************/
+#ifdef KMA_RMAP
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*  The resource map is the classic SVR4 rmalloc() map: one <base,
+ *  size> pair per free extent, sorted by base. It is kept out of band,
+ *  in a run of pages of its own, as two arrays (bases and sizes), so
+ *  nothing is written into the free space and a request is only
+ *  rounded up to ALIGN.
+ *
+ *  kma_malloc scans the sizes for the first extent that fits and takes
+ *  its front, which keeps the order. kma_free finds its place with a
+ *  binary search on the bases and merges with the extent before and
+ *  after it when they touch; otherwise the tail of the arrays moves up
+ *  by one. Extents never span two pages, so a page is empty when one
+ *  extent covers all of it, and it goes back to the page layer, which
+ *  retains it for a while.
+ *
+ *  The map doubles its run of pages when it is full and gives it back
+ *  once it is empty. Spaces larger than a page get pages of their own.
+ */
+#define ALIGN 8
+
+/************Global Variables*********************************************/
+static kma_page_t* g_meta = NULL;
+static int g_metapages = 0;
+static char** g_base = NULL;
+static int* g_size = NULL;
+static int g_count = 0;
+static int g_capacity = 0;
+
+/************Function Prototypes******************************************/
+int find_entry(char* base);
+void insert_entry(int i, char* base, int size);
+void remove_entry(int i);
+void grow_map();
+int new_page();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  char* ptr;
+  int i;
+  
+  if (size > PAGESIZE)
+    {
+      return get_pages((size + PAGESIZE - 1) / PAGESIZE)->ptr;
+    }
+  
+  size = size == 0 ? ALIGN : (size + ALIGN - 1) & ~(ALIGN - 1);
+  
+  // first fit: a linear scan of packed sizes
+  for (i = 0; i < g_count; i++)
+    {
+      if (g_size[i] >= size)
+	{
+	  break;
+	}
+    }
+  if (i == g_count)
+    {
+      i = new_page();
+    }
+  
+  ptr = g_base[i];
+  g_base[i] += size;
+  g_size[i] -= size;
+  if (g_size[i] == 0)
+    {
+      remove_entry(i);
+    }
+  
+  return ptr;
+}
+
+void*
+kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  void* ptr;
+  
+  if (size != 0 && nmemb > INT_MAX / size)
+    {
+      return NULL;
+    }
+  
+  // a large space gets pages that are zero already
+  if (nmemb * size > PAGESIZE)
+    {
+      return get_zeroed_pages((nmemb * size + PAGESIZE - 1) / PAGESIZE)->ptr;
+    }
+  
+  ptr = kma_malloc(nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  char* base = (char*) ptr;
+  int i, left, right;
+  
+  if (size > PAGESIZE)
+    {
+      free_pages(page_of(ptr));
+      return;
+    }
+  
+  size = size == 0 ? ALIGN : (size + ALIGN - 1) & ~(ALIGN - 1);
+  
+  // the extents before and after the space, merged only within a page
+  i = find_entry(base);
+  left = i > 0 && g_base[i - 1] + g_size[i - 1] == base
+    && BASEADDR(g_base[i - 1]) == BASEADDR(base);
+  right = i < g_count && base + size == g_base[i]
+    && BASEADDR(g_base[i]) == BASEADDR(base);
+  
+  if (left && right)
+    {
+      g_size[i - 1] += size + g_size[i];
+      remove_entry(i);
+      i--;
+    }
+  else if (left)
+    {
+      g_size[--i] += size;
+    }
+  else if (right)
+    {
+      g_base[i] = base;
+      g_size[i] += size;
+    }
+  else
+    {
+      insert_entry(i, base, size);
+    }
+  
+  if (g_size[i] == PAGESIZE)
+    {
+      kma_page_t* page = page_of(g_base[i]);
+  
+      remove_entry(i);
+      retain_pages(&page, 1);
+    }
+}
+
+int
+find_entry(char* base)
+{
+  int low = 0;
+  int high = g_count;
+  
+  // the first extent after base
+  while (low < high)
+    {
+      int mid = (low + high) / 2;
+  
+      if (g_base[mid] < base)
+	{
+	  low = mid + 1;
+	}
+      else
+	{
+	  high = mid;
+	}
+    }
+  
+  return low;
+}
+
+void
+insert_entry(int i, char* base, int size)
+{
+  if (g_count == g_capacity)
+    {
+      grow_map();
+    }
+  
+  memmove(&g_base[i + 1], &g_base[i], (g_count - i) * sizeof(char*));
+  memmove(&g_size[i + 1], &g_size[i], (g_count - i) * sizeof(int));
+  g_base[i] = base;
+  g_size[i] = size;
+  g_count++;
+}
+
+void
+remove_entry(int i)
+{
+  g_count--;
+  memmove(&g_base[i], &g_base[i + 1], (g_count - i) * sizeof(char*));
+  memmove(&g_size[i], &g_size[i + 1], (g_count - i) * sizeof(int));
+  
+  // the map holds no page once it is empty
+  if (g_count == 0)
+    {
+      free_pages(g_meta);
+      g_meta = NULL;
+      g_metapages = 0;
+      g_capacity = 0;
+    }
+}
+
+void
+grow_map()
+{
+  int pages = g_metapages == 0 ? 1 : 2 * g_metapages;
+  kma_page_t* meta = get_pages(pages);
+  int capacity = pages * PAGESIZE / (sizeof(char*) + sizeof(int));
+  char** base = (char**) meta->ptr;
+  int* size = (int*) (base + capacity);
+  
+  if (g_meta != NULL)
+    {
+      memcpy(base, g_base, g_count * sizeof(char*));
+      memcpy(size, g_size, g_count * sizeof(int));
+      free_pages(g_meta);
+    }
+  
+  g_meta = meta;
+  g_metapages = pages;
+  g_base = base;
+  g_size = size;
+  g_capacity = capacity;
+}
+
+int
+new_page()
+{
+  kma_page_t* page = reclaim_page(&g_meta);
+  int i;
+  
+  if (page == NULL)
+    {
+      page = get_page();
+      page->owner = &g_meta;
+    }
+  
+  i = find_entry(page->ptr);
+  insert_entry(i, page->ptr, PAGESIZE);
+  
+  return i;
+}
+
+#endif // KMA_RMAP
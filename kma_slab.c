@@ -0,0 +1,491 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the slab allocator
+ *             (object caches)
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.2  2009/10/31 21:28:52  jot836
+ *    This is the current version of KMA project 3.
+ *    It includes:
+ *    - the most up-to-date handout (F'09)
+ *    - updated skeleton including
+ *        file-driven test harness,
+ *        trace generator script,
+ *        support for evaluating efficiency of algorithm (wasted memory),
+ *        gnuplot support for plotting allocation and waste,
+ *        set of traces for all students to use (including a makefile and README of the settings),
+ *    - different version of the testsuite for use on the submission site, including:
+ *        scoreboard Python scripts, which posts the top 5 scores on the course webpage
+ *
+ *    Revision 1.1  2005/10/24 16:07:09  sbirrer
+ *    - skeleton
+ *
+ *    Revision 1.2  2004/11/05 15:45:56  sbirrer
+ *    - added size as a parameter to kma_free
+ *
+ *    Revision 1.1  2004/11/03 23:04:03  sbirrer
+ *    - initial version for the kernel memory allocator project
+ *
+ ***************************************************************************/
+#ifdef KMA_SLAB
+#define __KMA_IMPL__
+#define __KSLAB_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_slab.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*  A cache hands out objects of one size from slabs: runs of pages cut
+ *  into objects. The descriptor of a slab is the descriptor of its
+ *  first page (owner is the cache, freelist and nfree its free
+ *  objects, inuse its objects in use and sclass its color), so the
+ *  pages hold nothing but objects. The other pages of a slab point to
+ *  the first through next, with inuse set to -1.
+ *
+ *  Each cache keeps its slabs on three lists: partial slabs serve the
+ *  allocations, full slabs wait for a free and at most one empty slab
+ *  is held against the next allocation. Further empty slabs leave the
+ *  cache: single pages are retained with the cache as owner and come
+ *  back with their objects still constructed, other slabs are
+ *  destroyed. Slabs start their objects at offsets that cycle through
+ *  the space left over at the end of a slab (coloring), so the objects
+ *  of different slabs do not all fall into the same cache lines.
+ *
+ *  A free object is linked through its first word, or through a word
+ *  after it when the cache has a constructor, so a free object keeps
+ *  its constructed state. kma_malloc serves sizes up to MAXGENERIC from
+ *  a set of generic caches; larger spaces get pages of their own, with
+ *  no owner.
+ */
+#define CACHELINE 64
+#define MAXSLABPAGES 8
+// at most 1/WASTEFRAC of a slab is left over when that fits MAXSLABPAGES
+#define WASTEFRAC 8
+
+#define NUMGENERIC 18
+#define MAXGENERIC 8192
+#define SIZESTEP 16
+
+#define LINK(cache, obj) (*(void**) ((char*) (obj) + (cache)->link))
+
+struct kmem_cache
+{
+  char name[32];
+  // the size of the objects, and the size they take in a slab
+  int objsize;
+  int size;
+  // offset of the free link within an object
+  int link;
+  int pages;
+  int objs;
+  // colors are multiples of the color unit below the left over space
+  int colors;
+  int color;
+  int unit;
+  // objects handed out
+  int inuse;
+  kmem_ctor_t ctor;
+  kmem_ctor_t dtor;
+  kma_page_t* partial;
+  kma_page_t* full;
+  kma_page_t* empty;
+};
+
+/************Global Variables*********************************************/
+static const int kGenericSizes[NUMGENERIC] =
+  {
+    16,   32,   48,   64,   96,  128,  192,  256,  384,
+    512,  768, 1024, 1536, 2048, 3072, 4096, 6144, 8192
+  };
+
+// the caches behind kma_malloc, and the cache of their index per
+// SIZESTEP bytes
+static kmem_cache_t g_generic[NUMGENERIC];
+static unsigned char g_generic_of[MAXGENERIC / SIZESTEP];
+static int g_ready = 0;
+
+// the cache the descriptors of kmem_cache_create come from
+static kmem_cache_t g_cache_cache;
+
+/************Function Prototypes******************************************/
+void init_cache(kmem_cache_t* cache, char* name, int size, int align,
+		kmem_ctor_t ctor, kmem_ctor_t dtor);
+void init_generic();
+kma_page_t* grow_cache(kmem_cache_t* cache);
+kma_page_t* new_slab(kmem_cache_t* cache);
+void release_slab(kmem_cache_t* cache, kma_page_t* slab);
+kma_page_t* slab_of(void* obj);
+kma_page_t** slab_list(kmem_cache_t* cache, kma_page_t* slab);
+void link_slab(kma_page_t** list, kma_page_t* slab);
+void unlink_slab(kma_page_t** list, kma_page_t* slab);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  kma_page_t* page;
+  
+  if (size > MAXGENERIC)
+    {
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      return page->ptr;
+    }
+  
+  if (!g_ready)
+    {
+      init_generic();
+    }
+  
+  return kmem_cache_alloc(&g_generic[g_generic_of[size > 0 ? (size - 1) / SIZESTEP : 0]]);
+}
+
+void*
+kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  void* ptr;
+  
+  if (size != 0 && nmemb > INT_MAX / size)
+    {
+      return NULL;
+    }
+  
+  // a large space gets pages that are zero already
+  if (nmemb * size > MAXGENERIC)
+    {
+      return get_zeroed_pages((nmemb * size + PAGESIZE - 1) / PAGESIZE)->ptr;
+    }
+  
+  ptr = kma_malloc(nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  kma_page_t* slab = slab_of(ptr);
+  
+  if (slab->owner == NULL)
+    {
+      free_pages(slab);
+      return;
+    }
+  
+  kmem_cache_free(slab->owner, ptr);
+}
+
+kmem_cache_t*
+kmem_cache_create(char* name, kma_size_t size, kma_size_t align,
+		  kmem_ctor_t ctor, kmem_ctor_t dtor)
+{
+  kmem_cache_t* cache;
+  
+  assert(size > 0);
+  assert(align == 0 || (align & (align - 1)) == 0);
+  
+  if (g_cache_cache.size == 0)
+    {
+      init_cache(&g_cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0,
+		 NULL, NULL);
+    }
+  
+  cache = kmem_cache_alloc(&g_cache_cache);
+  init_cache(cache, name, size, align, ctor, dtor);
+  
+  return cache;
+}
+
+void*
+kmem_cache_alloc(kmem_cache_t* cache)
+{
+  kma_page_t* slab = cache->partial;
+  kma_page_t** list;
+  void* obj;
+  
+  if (slab == NULL)
+    {
+      slab = (cache->empty != NULL) ? cache->empty : grow_cache(cache);
+    }
+  
+  list = slab_list(cache, slab);
+  obj = slab->freelist;
+  slab->freelist = LINK(cache, obj);
+  slab->nfree--;
+  slab->inuse++;
+  cache->inuse++;
+  
+  if (slab_list(cache, slab) != list)
+    {
+      unlink_slab(list, slab);
+      link_slab(slab_list(cache, slab), slab);
+    }
+  
+  return obj;
+}
+
+void
+kmem_cache_free(kmem_cache_t* cache, void* obj)
+{
+  kma_page_t* slab = slab_of(obj);
+  kma_page_t** list = slab_list(cache, slab);
+  
+  assert(slab->owner == cache);
+  
+  LINK(cache, obj) = slab->freelist;
+  slab->freelist = obj;
+  slab->nfree++;
+  slab->inuse--;
+  cache->inuse--;
+  
+  if (slab_list(cache, slab) != list)
+    {
+      unlink_slab(list, slab);
+      if (slab->inuse == 0 && cache->empty != NULL)
+	{
+	  release_slab(cache, slab);
+	}
+      else
+	{
+	  link_slab(slab_list(cache, slab), slab);
+	}
+    }
+  
+  // an idle cache holds no slabs
+  if (cache->inuse == 0 && cache->empty != NULL)
+    {
+      slab = cache->empty;
+      unlink_slab(&cache->empty, slab);
+      release_slab(cache, slab);
+    }
+}
+
+void
+kmem_cache_destroy(kmem_cache_t* cache)
+{
+  kma_page_t* slab;
+  
+  assert(cache->inuse == 0);
+  assert(cache->partial == NULL && cache->full == NULL && cache->empty == NULL);
+  
+  // retained slabs must not outlive the descriptor they point to
+  while ((slab = reclaim_page(cache)) != NULL)
+    {
+      free_page(slab);
+    }
+  
+  kmem_cache_free(&g_cache_cache, cache);
+}
+
+void
+init_cache(kmem_cache_t* cache, char* name, int size, int align,
+	   kmem_ctor_t ctor, kmem_ctor_t dtor)
+{
+  int left;
+  
+  if (align < (int) sizeof(void*))
+    {
+      align = sizeof(void*);
+    }
+  
+  memset(cache, 0, sizeof(kmem_cache_t));
+  snprintf(cache->name, sizeof(cache->name), "%s", name);
+  cache->objsize = size;
+  cache->ctor = ctor;
+  cache->dtor = dtor;
+  
+  // with a constructor the free link goes behind the object
+  if (ctor != NULL)
+    {
+      cache->link = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+      size = cache->link + sizeof(void*);
+    }
+  cache->size = (size + align - 1) & ~(align - 1);
+  
+  // the smallest slab that leaves little over
+  cache->pages = (cache->size + PAGESIZE - 1) / PAGESIZE;
+  while (cache->pages < MAXSLABPAGES
+	 && (cache->pages * PAGESIZE) % cache->size > cache->pages * PAGESIZE / WASTEFRAC)
+    {
+      cache->pages++;
+    }
+  cache->objs = cache->pages * PAGESIZE / cache->size;
+  
+  left = cache->pages * PAGESIZE - cache->objs * cache->size;
+  cache->unit = (align > CACHELINE) ? align : CACHELINE;
+  cache->colors = left / cache->unit + 1;
+}
+
+void
+init_generic()
+{
+  char name[32];
+  int i, j = 0;
+  
+  for (i = 0; i < NUMGENERIC; i++)
+    {
+      snprintf(name, sizeof(name), "size-%d", kGenericSizes[i]);
+      init_cache(&g_generic[i], name, kGenericSizes[i], 0, NULL, NULL);
+  
+      for (; j * SIZESTEP < kGenericSizes[i]; j++)
+	{
+	  g_generic_of[j] = i;
+	}
+    }
+  
+  g_ready = 1;
+}
+
+kma_page_t*
+grow_cache(kmem_cache_t* cache)
+{
+  kma_page_t* slab = NULL;
+  
+  if (cache->pages == 1 && cache->dtor == NULL)
+    {
+      slab = reclaim_page(cache);
+    }
+  if (slab == NULL)
+    {
+      slab = new_slab(cache);
+    }
+  
+  link_slab(&cache->empty, slab);
+  
+  return slab;
+}
+
+kma_page_t*
+new_slab(kmem_cache_t* cache)
+{
+  kma_page_t* slab = get_pages(cache->pages);
+  int i;
+  
+  slab->owner = cache;
+  slab->sclass = cache->color * cache->unit;
+  cache->color = (cache->color + 1) % cache->colors;
+  
+  for (i = 1; i < cache->pages; i++)
+    {
+      kma_page_t* page = page_of(slab->ptr + i * PAGESIZE);
+  
+      // a mapped run has a single descriptor
+      if (page != slab)
+	{
+	  page->owner = cache;
+	  page->inuse = -1;
+	  page->next = slab;
+	}
+    }
+  
+  slab->nfree = cache->objs;
+  slab->freelist = NULL;
+  for (i = cache->objs - 1; i >= 0; i--)
+    {
+      void* obj = slab->ptr + slab->sclass + i * cache->size;
+  
+      if (cache->ctor != NULL)
+	{
+	  cache->ctor(obj, cache->objsize);
+	}
+      LINK(cache, obj) = slab->freelist;
+      slab->freelist = obj;
+    }
+  
+  return slab;
+}
+
+void
+release_slab(kmem_cache_t* cache, kma_page_t* slab)
+{
+  int i;
+  
+  // keep the constructed objects of a page around for a while
+  if (slab->size == PAGESIZE && cache->dtor == NULL)
+    {
+      retain_pages(&slab, 1);
+      return;
+    }
+  
+  if (cache->dtor != NULL)
+    {
+      for (i = 0; i < cache->objs; i++)
+	{
+	  cache->dtor(slab->ptr + slab->sclass + i * cache->size, cache->objsize);
+	}
+    }
+  
+  free_pages(slab);
+}
+
+kma_page_t*
+slab_of(void* obj)
+{
+  kma_page_t* page = page_of(obj);
+  
+  return (page->inuse < 0) ? page->next : page;
+}
+
+kma_page_t**
+slab_list(kmem_cache_t* cache, kma_page_t* slab)
+{
+  if (slab->nfree == 0)
+    {
+      return &cache->full;
+    }
+  
+  return (slab->inuse == 0) ? &cache->empty : &cache->partial;
+}
+
+void
+link_slab(kma_page_t** list, kma_page_t* slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if (slab->next != NULL)
+    {
+      slab->next->prev = slab;
+    }
+  *list = slab;
+}
+
+void
+unlink_slab(kma_page_t** list, kma_page_t* slab)
+{
+  if (slab->prev != NULL)
+    {
+      slab->prev->next = slab->next;
+    }
+  else
+    {
+      *list = slab->next;
+    }
+  if (slab->next != NULL)
+    {
+      slab->next->prev = slab->prev;
+    }
+}
+
+#endif // KMA_SLAB
@@ -0,0 +1,89 @@
+/***************************************************************************
+ *  Title: Kernel Object Caches
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for the object caches of the slab allocator
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+#ifndef __KSLAB_H__
+#define __KSLAB_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KSLAB_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* a cache of objects of one size; the objects are kept constructed
+ * while they are free */
+typedef struct kmem_cache kmem_cache_t;
+
+// constructor and destructor: the object and the size of the cache
+typedef void (*kmem_ctor_t)(void*, kma_size_t);
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Creates an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Creates a cache of objects of the given size and
+ *             alignment. The constructor runs once per object when a
+ *             slab is added to the cache and the destructor once when
+ *             the slab leaves it, so a freed object must be handed
+ *             back in its constructed state. Either may be NULL.
+ *    Input: the name, the object size, the alignment (0 for the
+ *           default), the constructor, the destructor
+ *    Output: the cache
+ ***********************************************************************/
+EXTERN kmem_cache_t* kmem_cache_create(char*, kma_size_t, kma_size_t,
+				       kmem_ctor_t, kmem_ctor_t);
+
+/***********************************************************************
+ *  Title: Allocates an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes a constructed object from a cache
+ *    Input: the cache
+ *    Output: the object
+ ***********************************************************************/
+EXTERN void* kmem_cache_alloc(kmem_cache_t*);
+
+/***********************************************************************
+ *  Title: Releases an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Hands an object in its constructed state back to the
+ *             cache it came from
+ *    Input: the cache, the object
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kmem_cache_free(kmem_cache_t*, void*);
+
+/***********************************************************************
+ *  Title: Destroys an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Destroys a cache and returns its pages; every object
+ *             must have been freed
+ *    Input: the cache
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kmem_cache_destroy(kmem_cache_t*);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KSLAB_H__ */
@@ -0,0 +1,388 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on two-level segregated fit
+ *             (TLSF)
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.2  2009/10/31 21:28:52  jot836
+ *    This is the current version of KMA project 3.
+ *    It includes:
+ *    - the most up-to-date handout (F'09)
+ *    - updated skeleton including
+ *        file-driven test harness,
+ *        trace generator script,
+ *        support for evaluating efficiency of algorithm (wasted memory),
+ *        gnuplot support for plotting allocation and waste,
+ *        set of traces for all students to use (including a makefile and README of the settings),
+ *    - different version of the testsuite for use on the submission site, including:
+ *        scoreboard Python scripts, which posts the top 5 scores on the course webpage
+ *
+ *    Revision 1.1  2005/10/24 16:07:09  sbirrer
+ *    - skeleton
+ *
+ *    Revision 1.2  2004/11/05 15:45:56  sbirrer
+ *    - added size as a parameter to kma_free
+ *
+ *    Revision 1.1  2004/11/03 23:04:03  sbirrer
+ *    - initial version for the kernel memory allocator project
+ *
+ ***************************************************************************/
+#ifdef KMA_TLSF
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*  Blocks are carved out of areas of AREAPAGES pages. Every block
+ *  starts with a header holding its size, a free bit and a pointer to
+ *  the block physically before it (the boundary tag), so a freed block
+ *  merges with both neighbours in constant time. An area ends in a
+ *  used block of size 0, and its first block has no previous block.
+ *
+ *  Free blocks are kept on segregated lists: the first level splits
+ *  sizes by powers of two, the second level splits each power of two
+ *  into SLCOUNT ranges (sizes below SMALLSIZE go in steps of ALIGN).
+ *  A bitmap per level tells which lists have blocks, so finding a
+ *  list with a block large enough is two find-first-set operations and
+ *  both kma_malloc and kma_free take constant time. A search rounds
+ *  the size up to the next list, so any block found fits (good fit).
+ *
+ *  An area whose blocks are all free again goes back to the page
+ *  layer, which retains it for a while. Spaces larger than a block get
+ *  pages of their own.
+ */
+#define ALIGNSHIFT 4
+#define ALIGN (1 << ALIGNSHIFT)
+#define SLSHIFT 4
+#define SLCOUNT (1 << SLSHIFT)
+#define FLSHIFT (SLSHIFT + ALIGNSHIFT)
+#define SMALLSIZE (1 << FLSHIFT)
+
+#define AREAPAGES 1
+#define AREASIZE (AREAPAGES * PAGESIZE)
+// first-level lists: one for small blocks, one per power of two above
+#define FLCOUNT (__builtin_ctz(AREASIZE) - FLSHIFT + 1)
+
+#define FREEBIT 1UL
+#define SIZEMASK (~(unsigned long) (ALIGN - 1))
+
+typedef struct block
+{
+  struct block* prev_phys;
+  unsigned long size;
+  // only while the block is free
+  struct block* next_free;
+  struct block* prev_free;
+} block_t;
+
+#define HEADER offsetof(block_t, next_free)
+#define MINBLOCK (sizeof(block_t) - HEADER)
+// an area holds one block and the end marker
+#define MAXBLOCK (AREASIZE - 2 * HEADER)
+
+#define PAYLOAD(b) ((void*) ((char*) (b) + HEADER))
+#define BLOCK(p) ((block_t*) ((char*) (p) - HEADER))
+#define SIZE(b) ((b)->size & SIZEMASK)
+#define NEXTPHYS(b) ((block_t*) ((char*) PAYLOAD(b) + SIZE(b)))
+
+/************Global Variables*********************************************/
+static unsigned int g_fl_bitmap = 0;
+static unsigned int g_sl_bitmap[FLCOUNT];
+static block_t* g_blocks[FLCOUNT][SLCOUNT];
+
+/************Function Prototypes******************************************/
+int fls_int(unsigned int word);
+void mapping_insert(unsigned long size, int* fl, int* sl);
+void mapping_search(unsigned long size, int* fl, int* sl);
+block_t* find_block(unsigned long size);
+void insert_block(block_t* block);
+void remove_block(block_t* block);
+block_t* new_area();
+void release_area(block_t* block);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  unsigned long need;
+  block_t* block;
+  
+  if (size > MAXBLOCK)
+    {
+      return get_pages((size + PAGESIZE - 1) / PAGESIZE)->ptr;
+    }
+  
+  need = (size + ALIGN - 1) & SIZEMASK;
+  if (need < MINBLOCK)
+    {
+      need = MINBLOCK;
+    }
+  
+  block = find_block(need);
+  if (block == NULL)
+    {
+      block = new_area();
+    }
+  else
+    {
+      remove_block(block);
+    }
+  
+  // give the rest back if it can make a block of its own
+  if (SIZE(block) >= need + sizeof(block_t))
+    {
+      block_t* rest = (block_t*) ((char*) PAYLOAD(block) + need);
+  
+      rest->prev_phys = block;
+      rest->size = SIZE(block) - need - HEADER;
+      NEXTPHYS(rest)->prev_phys = rest;
+      block->size = need;
+      insert_block(rest);
+    }
+  
+  block->size &= ~FREEBIT;
+  
+  return PAYLOAD(block);
+}
+
+void*
+kma_calloc(kma_size_t nmemb, kma_size_t size)
+{
+  void* ptr;
+  
+  if (size != 0 && nmemb > INT_MAX / size)
+    {
+      return NULL;
+    }
+  
+  // a large space gets pages that are zero already
+  if (nmemb * size > MAXBLOCK)
+    {
+      return get_zeroed_pages((nmemb * size + PAGESIZE - 1) / PAGESIZE)->ptr;
+    }
+  
+  ptr = kma_malloc(nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  block_t* block = BLOCK(ptr);
+  block_t* next;
+  
+  if (size > MAXBLOCK)
+    {
+      free_pages(page_of(ptr));
+      return;
+    }
+  
+  // merge with the free neighbours, found through the boundary tags
+  if (block->prev_phys != NULL && (block->prev_phys->size & FREEBIT))
+    {
+      block_t* prev = block->prev_phys;
+  
+      remove_block(prev);
+      prev->size += HEADER + SIZE(block);
+      block = prev;
+    }
+  next = NEXTPHYS(block);
+  if (next->size & FREEBIT)
+    {
+      remove_block(next);
+      block->size += HEADER + SIZE(next);
+    }
+  NEXTPHYS(block)->prev_phys = block;
+  
+  block->size |= FREEBIT;
+  if (block->prev_phys == NULL && SIZE(block) == MAXBLOCK)
+    {
+      release_area(block);
+      return;
+    }
+  
+  insert_block(block);
+}
+
+int
+fls_int(unsigned int word)
+{
+  return 8 * sizeof(int) - 1 - __builtin_clz(word);
+}
+
+void
+mapping_insert(unsigned long size, int* fl, int* sl)
+{
+  int bit;
+  
+  if (size < SMALLSIZE)
+    {
+      *fl = 0;
+      *sl = size / (SMALLSIZE / SLCOUNT);
+      return;
+    }
+  
+  bit = fls_int(size);
+  *sl = (size >> (bit - SLSHIFT)) ^ SLCOUNT;
+  *fl = bit - FLSHIFT + 1;
+}
+
+void
+mapping_search(unsigned long size, int* fl, int* sl)
+{
+  // round up to the next list, so any block on it is large enough
+  if (size >= SMALLSIZE)
+    {
+      size += (1UL << (fls_int(size) - SLSHIFT)) - 1;
+    }
+  
+  mapping_insert(size, fl, sl);
+}
+
+block_t*
+find_block(unsigned long size)
+{
+  unsigned int map;
+  int fl, sl;
+  
+  mapping_search(size, &fl, &sl);
+  if (fl >= FLCOUNT)
+    {
+      return NULL;
+    }
+  
+  map = g_sl_bitmap[fl] & (~0U << sl);
+  if (map == 0)
+    {
+      // no block on this level: take the next level that has any
+      map = g_fl_bitmap & (~0U << (fl + 1));
+      if (map == 0)
+	{
+	  return NULL;
+	}
+      fl = __builtin_ctz(map);
+      map = g_sl_bitmap[fl];
+    }
+  sl = __builtin_ctz(map);
+  
+  return g_blocks[fl][sl];
+}
+
+void
+insert_block(block_t* block)
+{
+  int fl, sl;
+  
+  mapping_insert(SIZE(block), &fl, &sl);
+  
+  block->size |= FREEBIT;
+  block->prev_free = NULL;
+  block->next_free = g_blocks[fl][sl];
+  if (block->next_free != NULL)
+    {
+      block->next_free->prev_free = block;
+    }
+  g_blocks[fl][sl] = block;
+  
+  g_fl_bitmap |= 1U << fl;
+  g_sl_bitmap[fl] |= 1U << sl;
+}
+
+void
+remove_block(block_t* block)
+{
+  int fl, sl;
+  
+  mapping_insert(SIZE(block), &fl, &sl);
+  
+  if (block->prev_free != NULL)
+    {
+      block->prev_free->next_free = block->next_free;
+    }
+  else
+    {
+      g_blocks[fl][sl] = block->next_free;
+      if (g_blocks[fl][sl] == NULL)
+	{
+	  g_sl_bitmap[fl] &= ~(1U << sl);
+	  if (g_sl_bitmap[fl] == 0)
+	    {
+	      g_fl_bitmap &= ~(1U << fl);
+	    }
+	}
+    }
+  if (block->next_free != NULL)
+    {
+      block->next_free->prev_free = block->prev_free;
+    }
+  
+  block->size &= ~FREEBIT;
+}
+
+block_t*
+new_area()
+{
+  kma_page_t* page = NULL;
+  block_t* block;
+  block_t* end;
+  
+  if (AREAPAGES == 1)
+    {
+      page = reclaim_page(g_blocks);
+    }
+  if (page == NULL)
+    {
+      page = get_pages(AREAPAGES);
+      page->owner = g_blocks;
+    }
+  
+  // one block over the whole area, followed by the end marker
+  block = (block_t*) page->ptr;
+  block->prev_phys = NULL;
+  block->size = MAXBLOCK;
+  end = NEXTPHYS(block);
+  end->prev_phys = block;
+  end->size = 0;
+  
+  return block;
+}
+
+void
+release_area(block_t* block)
+{
+  kma_page_t* page = page_of(block);
+  
+  if (AREAPAGES == 1)
+    {
+      retain_pages(&page, 1);
+      return;
+    }
+  
+  free_pages(page);
+}
+
+#endif // KMA_TLSF
@@ -65,6 +65,26 @@
 
 typedef int kma_size_t;
 
+/* built with -DKMA_MAGAZINE, the magazine layer (kma_mag.c) takes the
+ * kma_ names and the algorithm built with it becomes its backend */
+#if defined(KMA_MAGAZINE) && defined(__KMA_IMPL__) && !defined(__KMA_MAG_IMPL__)
+#define kma_malloc kma_backend_malloc
+#define kma_calloc kma_backend_calloc
+#define kma_free kma_backend_free
+#endif
+
+#ifdef KMA_MAGAZINE
+typedef struct
+{
+  // calls into the backend, magazines traded with the depots, depot
+  // locks that had to wait and the most rounds a magazine got
+  int num_backend;
+  int num_exchanges;
+  int num_contended;
+  int max_rounds;
+} kma_mag_stat_t;
+#endif
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -80,6 +100,17 @@ typedef int kma_size_t;
  ***********************************************************************/
 EXTERN void* kma_malloc(kma_size_t size);
 
+/***********************************************************************
+ *  Title: Allocates zeroed kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates space for nmemb elements of size bytes each,
+ *             filled with zeros; it is freed with kma_free() and a
+ *             size of nmemb * size
+ *    Input: the number of elements, the size of an element
+ *    Output: the allocated zeroed memory or NULL on failure
+ ***********************************************************************/
+EXTERN void* kma_calloc(kma_size_t nmemb, kma_size_t size);
+
 /***********************************************************************
  *  Title: Frees kernel memory spaced
  * ---------------------------------------------------------------------
@@ -91,6 +122,17 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+#ifdef KMA_MAGAZINE
+/***********************************************************************
+ *  Title: Magazine layer statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the statistics of the magazine layer
+ *    Input: none
+ *    Output: the magazine statistics in a static buffer
+ ***********************************************************************/
+EXTERN kma_mag_stat_t* mag_stats();
+#endif
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
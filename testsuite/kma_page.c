@@ -45,6 +45,12 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -57,124 +63,1746 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+#define REGIONSIZE ((long) REGIONPAGES * PAGESIZE)
+#define COMMITSIZE ((long) COMMITPAGES * PAGESIZE)
+
+// pages kept per thread cache, pages kept in the global depot before it
+// hands some back to the regions, and number of thread caches
+#define CACHEPAGES 32
+#define DEPOTPAGES 256
+#define MAXTHREADS 64
+
+// in huge page mode regions are aligned to HUGESIZE; a commit chunk
+// (COMMITSIZE) is exactly one huge page, so the frontier fills one
+// extent before it starts on the next
+#define HUGESIZE (2L * 1024 * 1024)
+
+// in bitmap mode (-DKMA_PAGEBITMAP) a region keeps a bit per page below
+// its frontier, set while the page is free, and always hands out the
+// lowest free pages; single pages then skip the thread caches and the
+// depot, which would hand out the most recently freed page instead.
+// BITS is the number of pages per bitmap word
+#define BITS (8 * (int) sizeof(unsigned long))
+
+// pre-zeroed single pages kept at most, and pages zeroed in one go
+#define ZEROPAGES 64
+#define ZEROBATCH 8
+
+// owners that can have pages retained at once, calls a thread makes
+// before it advances the shared decay clock, and the default decay in
+// calls and in milliseconds (see page_decay())
+#define MAXOWNERS 64
+#define DECAYTICK 64
+#define DECAYOPS 4096
+#define DECAYMS 1000
+
+// header of a free run of contiguous pages, kept in its first page
+typedef struct free_run
+{
+  int npages;
+  struct free_run* next;
+} kma_run_t;
+
+// a run mapped from the OS outside the regions; its descriptor cannot
+// live in a frame table, so these are kept in a list of their own
+typedef struct mapped_run
+{
+  kma_page_t page;
+  struct mapped_run* prev;
+  struct mapped_run* next;
+} kma_mapped_t;
+
+// a reserved range of the virtual address space; only the part below
+// committed is backed by read/write memory. Pages below frontier have
+// been handed out at least once, freed ones are recycled through
+// next_free_page (single pages) and free_runs (address ordered runs),
+// and pages above frontier have never been touched. In bitmap mode the
+// frontier also moves down over freed pages, so pages from clean up
+// are the ones known to hold only the zeros the OS gave them. frames
+// holds the descriptor of every page, indexed by (page - base) / PAGESIZE.
+// In bitmap mode free_map replaces the free list and free runs, and
+// no word of it below map_low has a bit set.
+// A region that runs empty is idle until it is used again or decays.
+typedef struct
+{
+  void* base;
+  kma_page_t* frames;
+  void* frontier;
+  void* clean;
+  void* committed;
+  void* next_free_page;
+  kma_run_t* free_runs;
+  unsigned long* free_map;
+  int map_low;
+  int num_in_use;
+  int idle;
+  unsigned long idle_ops;
+  long idle_ms;
+} kma_region_t;
+
+// a small stack of free pages (frame indices) in front of the depot.
+// Every thread attaches to one; the lock is only contended while
+// another thread steals from it.
+typedef struct
+{
+  int lock;
+  int users;
+  int count;
+  int pages[CACHEPAGES];
+  kma_page_stat_t stats;
+} kma_cache_t;
+
+// pages retained for one owner (frame indices linked through
+// depot_next), stamped with the decay clock of the last retain
+typedef struct
+{
+  void* owner;
+  int head;
+  int count;
+  unsigned long ops;
+  long ms;
+} kma_retained_t;
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_region_t regions[MAXREGIONS];
+static int num_regions = 0;
 
-static void* pool = NULL;
-static void* next_free_page = NULL;
+static kma_mapped_t* mapped_runs = NULL;
+
+// regions, free runs and mapped runs are only changed under pool_lock
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// global depot of free pages: a Treiber stack of frame indices linked
+// through depot_next. The head packs a tag (high word) with the top
+// index plus one (low word, 0 when empty) so a stale CAS fails (ABA).
+static unsigned long depot_head = 0;
+static int depot_count = 0;
+
+static kma_cache_t caches[MAXTHREADS];
+static int num_caches = 0;
+static __thread kma_cache_t* my_cache = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+// huge page mode: on by default when built with -DKMA_HUGEPAGES, and
+// switched on or off at runtime with KMA_HUGEPAGES=1/0 in the environment
+static int huge_pages = -1;
+
+// retention (see page_decay()); decay_clock counts page allocator
+// calls, num_pending counts retained groups and idle regions, and
+// pool_stats keeps the retention counters. All of it is under pool_lock
+// except for the atomic peeks that skip the lock when nothing is kept.
+static int decay_ops = -1;
+static int decay_ms = -1;
+static unsigned long decay_clock = 0;
+static int num_pending = 0;
+static kma_retained_t retained[MAXOWNERS];
+static kma_page_stat_t pool_stats;
+static __thread int my_ops = 0;
+
+// pool of pre-zeroed single pages (frame indices) for get_zeroed_pages().
+// zero_lock is never held together with another lock. The pool is
+// filled by the zeroing thread, which waits on zero_wanted until the
+// pool runs low; it runs by default when built with -DKMA_ZEROTHREAD
+// and can be switched on or off with KMA_ZEROTHREAD=1/0 in the
+// environment. Without it only pages fresh from the OS skip zeroing.
+static pthread_mutex_t zero_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zero_wanted = PTHREAD_COND_INITIALIZER;
+static pthread_once_t zero_once = PTHREAD_ONCE_INIT;
+static int zero_pool[ZEROPAGES];
+static int zero_count = 0;
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
-void initPages();
+void zeroBatch(int*, int);
+void zeroPage(void*);
+void poolZeroed(int*, int);
+void startZeroing();
+void* zeroLoop(void*);
+kma_cache_t* attachCache();
+void detachCache(void*);
+void createCacheKey();
+void lockCache(kma_cache_t*);
+void unlockCache(kma_cache_t*);
+void initPage(kma_page_t*, int);
+int cachedPage(kma_cache_t*);
+void uncachePage(kma_cache_t*, int);
+void trimDepot();
+int stealPages(kma_cache_t*);
+void depotPush(int*, int);
+int depotPop();
+void flushDepot();
+int frameIndex(void*);
+kma_page_t* frameAt(int);
+void* pageAddr(int);
+kma_page_t* mapRun(int);
+void unmapRun(kma_page_t*);
+void* allocPages(int);
+void* allocFromRegion(kma_region_t*, int);
+void* firstFit(kma_region_t*, int);
+void* lowestFree(kma_region_t*, int);
+void freePages(void*, int);
+void insertRun(kma_region_t*, void*, int);
+void markFree(kma_region_t*, void*, int);
+void trimTail(kma_region_t*);
+void* mapAligned(long, long, int, int);
+void* mapRegion();
+int hugePages();
+int retaining();
+kma_retained_t* retainGroup(void*);
+void purgeGroup(kma_retained_t*);
+void decayTick();
+void decayPool();
+int decayed(unsigned long, long);
+long clockMs();
+kma_region_t* reserveRegion();
+kma_region_t* findRegion(void*);
+void commitPages(kma_region_t*);
+void releaseRegion(kma_region_t*);
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
+// Returns address to a kma_page_t
 kma_page_t*
 get_page()
 {
-  static int id = 0;
+  return get_pages(1);
+}
+
+kma_page_t*
+get_pages(int n)
+{
+  kma_cache_t* cache = attachCache();
   kma_page_t* res;
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  assert(n > 0);
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  if (n == 1)
+    {
+      int page;
+      
+      lockCache(cache);
+      page = cachedPage(cache);
+      cache->stats.num_requested++;
+      cache->stats.num_in_use++;
+      unlockCache(cache);
+      
+      res = frameAt(page);
+      res->ptr = pageAddr(page);
+    }
+  else
+    {
+      pthread_mutex_lock(&pool_lock);
+      if (n >= MMAPPAGES)
+	{
+	  // very large runs bypass the pool and are mapped on their own
+	  res = mapRun(n);
+	}
+      else
+	{
+	  void* ptr = allocPages(n);
+	  
+	  res = frameAt(frameIndex(ptr));
+	  res->ptr = ptr;
+	}
+      pthread_mutex_unlock(&pool_lock);
+      
+      lockCache(cache);
+      cache->stats.num_requested += n;
+      cache->stats.num_in_use += n;
+      unlockCache(cache);
+    }
   
-  assert(res->ptr != NULL);
+  initPage(res, n);
+  decayTick();
   
   return res;	
 }
 
+int
+get_pages_bulk(kma_page_t** pages, int n)
+{
+  kma_cache_t* cache = attachCache();
+  int i, page;
+  
+  // one trip through the cache lock for the whole batch
+  lockCache(cache);
+  for (i = 0; i < n; i++)
+    {
+      page = cachedPage(cache);
+      pages[i] = frameAt(page);
+      pages[i]->ptr = pageAddr(page);
+    }
+  cache->stats.num_requested += n;
+  cache->stats.num_in_use += n;
+  unlockCache(cache);
+  
+  for (i = 0; i < n; i++)
+    {
+      initPage(pages[i], 1);
+    }
+  decayTick();
+  
+  return n;
+}
+
+kma_page_t*
+get_zeroed_pages(int n)
+{
+  kma_cache_t* cache;
+  kma_page_t* res;
+  int page = -1;
+  
+  if (n > 1)
+    {
+      // runs fresh from the OS are zero already
+      res = get_pages(n);
+      if (!res->zeroed)
+	{
+	  memset(res->ptr, 0, res->size);
+	  res->zeroed = 1;
+	}
+      return res;
+    }
+  
+  pthread_once(&zero_once, startZeroing);
+  
+  pthread_mutex_lock(&zero_lock);
+  if (zero_count > 0)
+    {
+      page = zero_pool[--zero_count];
+      // wake the zeroing thread once, as the pool reaches its low mark
+      if (zero_count == ZEROPAGES / 4)
+	{
+	  pthread_cond_signal(&zero_wanted);
+	}
+    }
+  pthread_mutex_unlock(&zero_lock);
+  
+  cache = attachCache();
+  lockCache(cache);
+  if (page < 0)
+    {
+      page = cachedPage(cache);
+    }
+  cache->stats.num_requested++;
+  cache->stats.num_in_use++;
+  unlockCache(cache);
+  
+  res = frameAt(page);
+  res->ptr = pageAddr(page);
+  initPage(res, 1);
+  if (!res->zeroed)
+    {
+      // nothing was zeroed ahead of time; the caller is about to use
+      // the page, so plain stores that leave it in the cache are best
+      memset(res->ptr, 0, PAGESIZE);
+      res->zeroed = 1;
+    }
+  decayTick();
+  
+  return res;
+}
+
 void
 free_page(kma_page_t* ptr)
 {
+  free_pages(ptr);
+}
+
+void
+free_pages(kma_page_t* ptr)
+{
+  kma_cache_t* cache = attachCache();
+  int n;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  n = ptr->size / PAGESIZE;
+  ptr->zeroed = 0;
+  
+  lockCache(cache);
+  if (n == 1)
+    {
+      uncachePage(cache, frameIndex(ptr->ptr));
+    }
+  cache->stats.num_freed += n;
+  cache->stats.num_in_use -= n;
+  unlockCache(cache);
+  
+  if (n == 1)
+    {
+      trimDepot();
+    }
+  else
+    {
+      pthread_mutex_lock(&pool_lock);
+      if (n >= MMAPPAGES)
+	{
+	  unmapRun(ptr);
+	}
+      else
+	{
+	  freePages(ptr->ptr, n);
+	}
+      pthread_mutex_unlock(&pool_lock);
+    }
+  decayTick();
+}
+
+void
+free_pages_bulk(kma_page_t** pages, int n)
+{
+  kma_cache_t* cache = attachCache();
+  int i, runs = 0, total = 0;
+  
+  // single pages go back to the cache, all under one lock...
+  lockCache(cache);
+  for (i = 0; i < n; i++)
+    {
+      pages[i]->zeroed = 0;
+      total += pages[i]->size / PAGESIZE;
+      if (pages[i]->size == PAGESIZE)
+	{
+	  uncachePage(cache, frameIndex(pages[i]->ptr));
+	}
+      else
+	{
+	  runs++;
+	}
+    }
+  cache->stats.num_freed += total;
+  cache->stats.num_in_use -= total;
+  unlockCache(cache);
+  
+  if (runs < n)
+    {
+      trimDepot();
+    }
+  
+  // ...and runs to the pool, under one more
+  if (runs > 0)
+    {
+      pthread_mutex_lock(&pool_lock);
+      for (i = 0; i < n; i++)
+	{
+	  if (pages[i]->size >= MMAPPAGES * PAGESIZE)
+	    {
+	      unmapRun(pages[i]);
+	    }
+	  else if (pages[i]->size > PAGESIZE)
+	    {
+	      freePages(pages[i]->ptr, pages[i]->size / PAGESIZE);
+	    }
+	}
+      pthread_mutex_unlock(&pool_lock);
+    }
+  decayTick();
+}
+
+void
+retain_pages(kma_page_t** pages, int n)
+{
+  kma_cache_t* cache = attachCache();
+  kma_retained_t* group = NULL;
+  int i, page;
+  
+  lockCache(cache);
+  cache->stats.num_freed += n;
+  cache->stats.num_in_use -= n;
+  unlockCache(cache);
+  
+  pthread_mutex_lock(&pool_lock);
+  for (i = 0; i < n; i++)
+    {
+      assert(pages[i]->size == PAGESIZE);
+      pages[i]->zeroed = 0;
+      
+      if (group == NULL || group->owner != pages[i]->owner)
+	{
+	  group = retainGroup(pages[i]->owner);
+	}
+      if (group == NULL)
+	{
+	  // retention is off, or every group is taken
+	  freePages(pages[i]->ptr, 1);
+	  continue;
+	}
+      
+      page = frameIndex(pages[i]->ptr);
+      __atomic_store_n(&pages[i]->depot_next, group->head, __ATOMIC_RELAXED);
+      group->head = page;
+      group->count++;
+      __atomic_add_fetch(&pool_stats.num_retained, 1, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock(&pool_lock);
+  
+  decayTick();
+}
+
+kma_page_t*
+reclaim_page(void* owner)
+{
+  kma_cache_t* cache;
+  int i, page = -1;
+  
+  if (__atomic_load_n(&pool_stats.num_retained, __ATOMIC_RELAXED) == 0)
+    {
+      return NULL;
+    }
+  
+  pthread_mutex_lock(&pool_lock);
+  for (i = 0; i < MAXOWNERS; i++)
+    {
+      kma_retained_t* group = &retained[i];
+      
+      if (group->count > 0 && group->owner == owner)
+	{
+	  page = group->head;
+	  group->head = frameAt(page)->depot_next;
+	  if (--group->count == 0)
+	    {
+	      __atomic_sub_fetch(&num_pending, 1, __ATOMIC_RELAXED);
+	    }
+	  __atomic_sub_fetch(&pool_stats.num_retained, 1, __ATOMIC_RELAXED);
+	  pool_stats.num_reclaimed++;
+	  break;
+	}
+    }
+  pthread_mutex_unlock(&pool_lock);
+  
+  if (page < 0)
+    {
+      return NULL;
+    }
+  
+  cache = attachCache();
+  lockCache(cache);
+  cache->stats.num_requested++;
+  cache->stats.num_in_use++;
+  unlockCache(cache);
+  
+  decayTick();
+  
+  return frameAt(page);
+}
+
+void
+page_decay(int ops, int ms)
+{
+  pthread_mutex_lock(&pool_lock);
+  decay_ops = ops;
+  decay_ms = ms;
+  // with retention turned off everything kept so far decays at once
+  decayPool();
+  pthread_mutex_unlock(&pool_lock);
+}
+
+kma_page_t*
+page_of(void* ptr)
+{
+  kma_region_t* region = findRegion(ptr);
+  kma_mapped_t* run;
+  kma_page_t* res = NULL;
+  
+  if (region != NULL)
+    {
+      return &region->frames[(BASEADDR(ptr) - region->base) / PAGESIZE];
+    }
+  
+  pthread_mutex_lock(&pool_lock);
+  for (run = mapped_runs; run != NULL; run = run->next)
+    {
+      if (ptr >= run->page.ptr && ptr < run->page.ptr + run->page.size)
+	{
+	  res = &run->page;
+	  break;
+	}
+    }
+  pthread_mutex_unlock(&pool_lock);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  return res;
 }
 
 kma_page_stat_t*
 page_stats()
 {
   static kma_page_stat_t stats;
+  int i;
+  
+  // the counters are kept per thread cache and summed up on read
+  stats.num_requested = 0;
+  stats.num_freed = 0;
+  stats.num_in_use = 0;
+  stats.page_size = PAGESIZE;
+  
+  for (i = 0; i < __atomic_load_n(&num_caches, __ATOMIC_ACQUIRE); i++)
+    {
+      lockCache(&caches[i]);
+      stats.num_requested += caches[i].stats.num_requested;
+      stats.num_freed += caches[i].stats.num_freed;
+      stats.num_in_use += caches[i].stats.num_in_use;
+      unlockCache(&caches[i]);
+    }
+  
+  pthread_mutex_lock(&pool_lock);
+  stats.num_retained = pool_stats.num_retained;
+  stats.num_reclaimed = pool_stats.num_reclaimed;
+  stats.num_purged = pool_stats.num_purged;
+  stats.num_regions_revived = pool_stats.num_regions_revived;
+  stats.num_regions_released = pool_stats.num_regions_released;
+  pthread_mutex_unlock(&pool_lock);
+  
+  return &stats;
+}
+
+void
+zeroBatch(int* pages, int count)
+{
+  int i;
+  
+  // recycled pages come from the depot, and only when it is empty from
+  // the regions (which often hand out fresh pages that are zero
+  // already); the thread caches are left alone. The pages stay free.
+  for (i = 0; i < count; i++)
+    {
+      pages[i] = depotPop();
+      if (pages[i] < 0)
+	{
+	  pthread_mutex_lock(&pool_lock);
+	  pages[i] = frameIndex(allocPages(1));
+	  pthread_mutex_unlock(&pool_lock);
+	}
+    }
+  
+  for (i = 0; i < count; i++)
+    {
+      kma_page_t* frame = frameAt(pages[i]);
+      
+      if (!frame->zeroed)
+	{
+	  zeroPage(pageAddr(pages[i]));
+	  frame->zeroed = 1;
+	}
+    }
+#ifdef __SSE2__
+  _mm_sfence();
+#endif
+}
+
+void
+zeroPage(void* ptr)
+{
+#ifdef __SSE2__
+  // streaming stores keep the zeroed page out of the CPU caches
+  __m128i zero = _mm_setzero_si128();
+  __m128i* line = (__m128i*) ptr;
+  int i;
+  
+  for (i = 0; i < PAGESIZE / (int) sizeof(__m128i); i += 4)
+    {
+      _mm_stream_si128(line + i, zero);
+      _mm_stream_si128(line + i + 1, zero);
+      _mm_stream_si128(line + i + 2, zero);
+      _mm_stream_si128(line + i + 3, zero);
+    }
+#else
+  memset(ptr, 0, PAGESIZE);
+#endif
+}
+
+void
+poolZeroed(int* pages, int count)
+{
+  int i = 0;
+  
+  pthread_mutex_lock(&zero_lock);
+  while (i < count && zero_count < ZEROPAGES)
+    {
+      zero_pool[zero_count++] = pages[i++];
+    }
+  pthread_mutex_unlock(&zero_lock);
+  
+  if (i == count)
+    {
+      return;
+    }
+  
+  // the pool is full: the rest go to the depot, still zeroed
+  depotPush(pages + i, count - i);
+  trimDepot();
+}
+
+void
+startZeroing()
+{
+  pthread_t thread;
+  char* env = getenv("KMA_ZEROTHREAD");
+  
+#ifdef KMA_ZEROTHREAD
+  if (env != NULL && atoi(env) == 0)
+#else
+  if (env == NULL || atoi(env) == 0)
+#endif
+    {
+      return;
+    }
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  if (pthread_create(&thread, NULL, zeroLoop, NULL) == 0)
+    {
+      pthread_detach(thread);
+    }
 }
 
 void*
-allocPage()
+zeroLoop(void* arg)
 {
-  void* res;
+  int pages[ZEROBATCH];
+  int room, count;
   
-  if (pool == NULL)
+  // sleep until the pool is down to a quarter, then fill it up a batch
+  // at a time, so the thread is woken rarely
+  for (;;)
     {
-      initPages();
+      pthread_mutex_lock(&zero_lock);
+      while (zero_count > ZEROPAGES / 4)
+	{
+	  pthread_cond_wait(&zero_wanted, &zero_lock);
+	}
+      room = ZEROPAGES - zero_count;
+      pthread_mutex_unlock(&zero_lock);
+      
+      while (room > 0)
+	{
+	  count = (room < ZEROBATCH) ? room : ZEROBATCH;
+	  zeroBatch(pages, count);
+	  poolZeroed(pages, count);
+	  room -= count;
+	}
     }
   
-  res = next_free_page;
+  return NULL;
+}
+
+kma_cache_t*
+attachCache()
+{
+  kma_cache_t* cache = my_cache;
+  int i;
   
-  if (res == NULL)
+  if (cache != NULL)
     {
-      error("error: all pages already allocated", "");
+      return cache;
     }
   
-  next_free_page = *((void**)next_free_page);
+  pthread_once(&cache_once, createCacheKey);
   
-  assert(res != NULL);
+  // reuse the cache of a thread that has exited, else take a new one;
+  // once all are taken, threads share them (every access is locked)
+  pthread_mutex_lock(&pool_lock);
+  for (i = 0; i < num_caches; i++)
+    {
+      if (caches[i].users == 0)
+	{
+	  cache = &caches[i];
+	  break;
+	}
+    }
+  if (cache == NULL && num_caches < MAXTHREADS)
+    {
+      cache = &caches[num_caches];
+      cache->stats.page_size = PAGESIZE;
+      __atomic_store_n(&num_caches, num_caches + 1, __ATOMIC_RELEASE);
+    }
+  if (cache == NULL)
+    {
+      cache = &caches[((unsigned long) &my_cache / sizeof(void*)) % MAXTHREADS];
+    }
+  cache->users++;
+  pthread_mutex_unlock(&pool_lock);
   
-  return res;
+  my_cache = cache;
+  pthread_setspecific(cache_key, cache);
+  
+  return cache;
 }
 
 void
-freePage(void* ptr)
+detachCache(void* arg)
 {
-  assert(ptr != NULL);
+  kma_cache_t* cache = (kma_cache_t*) arg;
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  // leave the cached pages in the depot; the counters stay with the
+  // cache so page_stats() still adds them up
+  lockCache(cache);
+  depotPush(cache->pages, cache->count);
+  cache->count = 0;
+  unlockCache(cache);
   
-  if (kma_page_stats.num_in_use == 0)
+  pthread_mutex_lock(&pool_lock);
+  cache->users--;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void
+createCacheKey()
+{
+  pthread_key_create(&cache_key, detachCache);
+}
+
+void
+lockCache(kma_cache_t* cache)
+{
+  while (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE))
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      while (__atomic_load_n(&cache->lock, __ATOMIC_RELAXED))
+	;
     }
 }
 
 void
-initPages()
+unlockCache(kma_cache_t* cache)
+{
+  __atomic_store_n(&cache->lock, 0, __ATOMIC_RELEASE);
+}
+
+void
+initPage(kma_page_t* page, int n)
+{
+  static int id = 0;
+  
+  assert(page->ptr != NULL);
+  
+  page->id = __atomic_fetch_add(&id, 1, __ATOMIC_RELAXED);
+  page->size = n * PAGESIZE;
+  page->owner = NULL;
+  page->sclass = 0;
+  page->inuse = 0;
+  page->nfree = 0;
+  page->freelist = NULL;
+  page->prev = NULL;
+  page->next = NULL;
+}
+
+int
+cachedPage(kma_cache_t* cache)
 {
+#ifdef KMA_PAGEBITMAP
+  void* ptr;
+  
+  // the lowest free page, straight from the regions
+  pthread_mutex_lock(&pool_lock);
+  ptr = allocPages(1);
+  pthread_mutex_unlock(&pool_lock);
+  
+  return frameIndex(ptr);
+#else
   int i;
   
-  assert(next_free_page == NULL);
-  assert(pool == NULL);
+  // refill an empty cache from another thread's cache, then from the
+  // depot, and only then from the regions (under the pool lock)
+  if (cache->count == 0 && stealPages(cache) == 0)
+    {
+      while (cache->count < CACHEPAGES / 2)
+	{
+	  int page = depotPop();
+	  
+	  if (page < 0)
+	    {
+	      break;
+	    }
+	  cache->pages[cache->count++] = page;
+	}
+    }
+  
+  if (cache->count == 0)
+    {
+      pthread_mutex_lock(&pool_lock);
+      for (i = 0; i < CACHEPAGES / 2; i++)
+	{
+	  cache->pages[cache->count++] = frameIndex(allocPages(1));
+	}
+      pthread_mutex_unlock(&pool_lock);
+    }
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  return cache->pages[--cache->count];
+#endif
+}
+
+void
+uncachePage(kma_cache_t* cache, int page)
+{
+#ifdef KMA_PAGEBITMAP
+  // back into the bitmap at once, so it can be the next one handed out
+  pthread_mutex_lock(&pool_lock);
+  freePages(pageAddr(page), 1);
+  pthread_mutex_unlock(&pool_lock);
+#else
+  // a full cache hands its older half to the depot
+  if (cache->count == CACHEPAGES)
+    {
+      depotPush(cache->pages, CACHEPAGES / 2);
+      memmove(cache->pages, cache->pages + CACHEPAGES / 2,
+	      (CACHEPAGES / 2) * sizeof(int));
+      cache->count -= CACHEPAGES / 2;
+    }
+  cache->pages[cache->count++] = page;
+#endif
+}
+
+void
+trimDepot()
+{
+  if (__atomic_load_n(&depot_count, __ATOMIC_RELAXED) > DEPOTPAGES)
+    {
+      flushDepot();
+    }
+}
+
+int
+stealPages(kma_cache_t* thief)
+{
+  int n = __atomic_load_n(&num_caches, __ATOMIC_ACQUIRE);
+  int start = thief - caches;
+  int i, take;
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  // the thief holds its own lock, so victims are only tried, never
+  // waited for, which rules out lock order deadlocks. The count is
+  // peeked without the lock; a stale value only skips or tries a victim.
+  for (i = 1; i < n; i++)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      kma_cache_t* victim = &caches[(start + i) % n];
+      
+      if (__atomic_load_n(&victim->count, __ATOMIC_RELAXED) < 2
+	  || __atomic_exchange_n(&victim->lock, 1, __ATOMIC_ACQUIRE))
+	{
+	  continue;
+	}
       
-      *((void**) ptr) = next;
+      // take the older half, which the victim is least likely to reuse
+      take = victim->count / 2;
+      if (take > 0)
+	{
+	  memcpy(thief->pages, victim->pages, take * sizeof(int));
+	  memmove(victim->pages, victim->pages + take,
+		  (victim->count - take) * sizeof(int));
+	  victim->count -= take;
+	  thief->count = take;
+	}
+      unlockCache(victim);
+      
+      if (take > 0)
+	{
+	  return take;
+	}
+    }
+  
+  return 0;
+}
+
+void
+depotPush(int* pages, int count)
+{
+  unsigned long old, new;
+  int i;
+  
+  if (count == 0)
+    {
+      return;
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  // chain the pages first and then publish the whole chain with one CAS
+  for (i = 0; i < count - 1; i++)
+    {
+      __atomic_store_n(&frameAt(pages[i])->depot_next, pages[i + 1],
+		       __ATOMIC_RELAXED);
+    }
+  
+  old = __atomic_load_n(&depot_head, __ATOMIC_ACQUIRE);
+  do
+    {
+      __atomic_store_n(&frameAt(pages[count - 1])->depot_next,
+		       (int) (old & 0xffffffff) - 1, __ATOMIC_RELAXED);
+      new = ((old >> 32) + 1) << 32 | (unsigned long) (pages[0] + 1);
+    }
+  while (!__atomic_compare_exchange_n(&depot_head, &old, new, 1,
+				      __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  
+  __atomic_add_fetch(&depot_count, count, __ATOMIC_RELAXED);
+}
+
+int
+depotPop()
+{
+  unsigned long old, new;
+  int top, next;
+  
+  old = __atomic_load_n(&depot_head, __ATOMIC_ACQUIRE);
+  do
+    {
+      top = (int) (old & 0xffffffff) - 1;
+      if (top < 0)
+	{
+	  return -1;
+	}
+      // the frame table is never unmapped, so a stale read is harmless;
+      // the tag makes the exchange fail if the top has changed meanwhile
+      next = __atomic_load_n(&frameAt(top)->depot_next, __ATOMIC_RELAXED);
+      new = ((old >> 32) + 1) << 32 | (unsigned long) (next + 1);
+    }
+  while (!__atomic_compare_exchange_n(&depot_head, &old, new, 1,
+				      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  
+  __atomic_sub_fetch(&depot_count, 1, __ATOMIC_RELAXED);
+  
+  return top;
+}
+
+void
+flushDepot()
+{
+  int i;
+  
+  // give half of the depot back to the regions, which can then return
+  // idle regions to the OS
+  pthread_mutex_lock(&pool_lock);
+  for (i = 0; i < DEPOTPAGES / 2; i++)
+    {
+      int page = depotPop();
+      
+      if (page < 0)
+	{
+	  break;
+	}
+      freePages(pageAddr(page), 1);
+    }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int
+frameIndex(void* ptr)
+{
+  kma_region_t* region = findRegion(ptr);
+  
+  assert(region != NULL);
+  
+  return (region - regions) * REGIONPAGES + (BASEADDR(ptr) - region->base) / PAGESIZE;
+}
+
+kma_page_t*
+frameAt(int index)
+{
+  return &regions[index / REGIONPAGES].frames[index % REGIONPAGES];
+}
+
+void*
+pageAddr(int index)
+{
+  return regions[index / REGIONPAGES].base + (long) (index % REGIONPAGES) * PAGESIZE;
+}
+
+kma_page_t*
+mapRun(int n)
+{
+  kma_mapped_t* run = (kma_mapped_t*) malloc(sizeof(kma_mapped_t));
+  
+  run->page.ptr = mapAligned((long) n * PAGESIZE, PAGESIZE,
+			     PROT_READ | PROT_WRITE, 0);
+  if (run->page.ptr == NULL)
+    {
+      error("unable to map memory for a large run", "mmap");
+    }
+  run->page.zeroed = 1;
+  run->prev = NULL;
+  run->next = mapped_runs;
+  if (mapped_runs != NULL)
+    {
+      mapped_runs->prev = run;
+    }
+  mapped_runs = run;
+  
+  return &run->page;
+}
+
+void
+unmapRun(kma_page_t* page)
+{
+  kma_mapped_t* run = (kma_mapped_t*) page;
+  
+  munmap(page->ptr, page->size);
+  
+  if (run->prev != NULL)
+    {
+      run->prev->next = run->next;
+    }
+  else
+    {
+      mapped_runs = run->next;
+    }
+  if (run->next != NULL)
+    {
+      run->next->prev = run->prev;
+    }
+  free(run);
+}
+
+void*
+allocPages(int n)
+{
+  kma_region_t* region;
+  void* res;
+  int i;
+  
+  // take the lowest region that can hold the run, so the live set
+  // stays packed into as few regions as possible
+  for (i = 0; i < num_regions; i++)
+    {
+      res = allocFromRegion(&regions[i], n);
+      if (res != NULL)
+	{
+	  return res;
+	}
+    }
+  
+  region = reserveRegion();
+  res = allocFromRegion(region, n);
+  
+  assert(res != NULL);
+  
+  return res;
+}
+
+void*
+allocFromRegion(kma_region_t* region, int n)
+{
+  void* res;
+  
+#ifdef KMA_PAGEBITMAP
+  res = lowestFree(region, n);
+#else
+  res = firstFit(region, n);
+#endif
+  
+  if (res != NULL)
+    {
+      region->frames[(res - region->base) / PAGESIZE].zeroed = 0;
+    }
+  
+  // bump the frontier; pages above clean are first touched by their new
+  // owner, so they still hold the zeros the OS gave them
+  if (res == NULL
+      && region->frontier + (long) n * PAGESIZE <= region->base + REGIONSIZE)
+    {
+      while (region->frontier + (long) n * PAGESIZE > region->committed)
+	{
+	  commitPages(region);
+	}
+      res = region->frontier;
+      region->frontier += (long) n * PAGESIZE;
+      region->frames[(res - region->base) / PAGESIZE].zeroed =
+	(res >= region->clean);
+      if (region->frontier > region->clean)
+	{
+	  region->clean = region->frontier;
+	}
+    }
+  
+  if (res != NULL)
+    {
+      region->num_in_use += n;
+      if (region->idle)
+	{
+	  // used again before it decayed
+	  region->idle = 0;
+	  __atomic_sub_fetch(&num_pending, 1, __ATOMIC_RELAXED);
+	  pool_stats.num_regions_revived++;
+	}
+    }
+  
+  return res;
+}
+
+void*
+firstFit(kma_region_t* region, int n)
+{
+  kma_run_t** link;
+  void* res = NULL;
+  
+  if (n == 1 && region->next_free_page != NULL)
+    {
+      // recycle a page that has been handed out before
+      res = region->next_free_page;
+      region->next_free_page = *((void**)res);
+      return res;
+    }
+  
+  // first fit over the free runs, carving from the tail of the run
+  // so its header stays where it is
+  for (link = &region->free_runs; *link != NULL; link = &(*link)->next)
+    {
+      kma_run_t* run = *link;
+      
+      if (run->npages >= n)
+	{
+	  run->npages -= n;
+	  res = ((void*) run) + run->npages * PAGESIZE;
+	  if (run->npages == 0)
+	    {
+	      *link = run->next;
+	    }
+	  break;
+	}
+    }
+  
+  return res;
+}
+
+void*
+lowestFree(kma_region_t* region, int n)
+{
+  unsigned long* map = region->free_map;
+  int words = ((region->frontier - region->base) / PAGESIZE + BITS - 1) / BITS;
+  int w, bit, start = 0, len = 0;
+  
+  // skip whole words at a time: empty words end a run, full words
+  // extend it, and only mixed words are looked at bit by bit
+  for (w = region->map_low; w < words && len < n; w++)
+    {
+      unsigned long word = map[w];
+      
+      if (word == 0)
+	{
+	  len = 0;
+	  if (w == region->map_low)
+	    {
+	      region->map_low++;
+	    }
+	  continue;
+	}
+      if (n == 1)
+	{
+	  start = w * BITS + __builtin_ctzl(word);
+	  len = 1;
+	  break;
+	}
+      if (word == ~0UL)
+	{
+	  if (len == 0)
+	    {
+	      start = w * BITS;
+	    }
+	  len += BITS;
+	  continue;
+	}
+      for (bit = 0; bit < BITS && len < n; bit++)
+	{
+	  if (word & (1UL << bit))
+	    {
+	      if (len++ == 0)
+		{
+		  start = w * BITS + bit;
+		}
+	    }
+	  else
+	    {
+	      len = 0;
+	    }
+	}
+    }
+  
+  if (len < n)
+    {
+      return NULL;
+    }
+  
+  for (bit = start; bit < start + n; bit++)
+    {
+      map[bit / BITS] &= ~(1UL << (bit % BITS));
+    }
+  
+  return region->base + (long) start * PAGESIZE;
+}
+
+void
+freePages(void* ptr, int n)
+{
+  kma_region_t* region;
+  
+  assert(ptr != NULL);
+  
+  region = findRegion(ptr);
+  assert(region != NULL);
+  assert(region->num_in_use >= n);
+  
+#ifdef KMA_PAGEBITMAP
+  markFree(region, ptr, n);
+  trimTail(region);
+#else
+  if (n == 1)
+    {
+      *((void**)ptr) = region->next_free_page;
+      region->next_free_page = ptr;
+    }
+  else
+    {
+      insertRun(region, ptr, n);
+    }
+#endif
+  region->num_in_use -= n;
+  
+  if (region->num_in_use == 0)
+    {
+      // an empty region is likely to be needed again soon, so it is
+      // only returned to the OS once it has decayed
+      if (retaining())
+	{
+	  region->idle = 1;
+	  region->idle_ops = __atomic_load_n(&decay_clock, __ATOMIC_RELAXED);
+	  region->idle_ms = clockMs();
+	  __atomic_add_fetch(&num_pending, 1, __ATOMIC_RELAXED);
+	}
+      else
+	{
+	  releaseRegion(region);
+	}
+    }
+}
+
+void
+insertRun(kma_region_t* region, void* ptr, int n)
+{
+  kma_run_t** link = &region->free_runs;
+  kma_run_t* prev = NULL;
+  kma_run_t* run = (kma_run_t*) ptr;
+  
+  while (*link != NULL && ((void*) *link) < ptr)
+    {
+      prev = *link;
+      link = &prev->next;
+    }
+  
+  run->npages = n;
+  run->next = *link;
+  
+  // merge with the run that follows
+  if (run->next != NULL && ptr + (long) n * PAGESIZE == (void*) run->next)
+    {
+      run->npages += run->next->npages;
+      run->next = run->next->next;
+    }
+  
+  // merge with the run that precedes
+  if (prev != NULL && ((void*) prev) + (long) prev->npages * PAGESIZE == ptr)
+    {
+      prev->npages += run->npages;
+      prev->next = run->next;
+    }
+  else
+    {
+      *link = run;
+    }
+}
+
+void
+markFree(kma_region_t* region, void* ptr, int n)
+{
+  int first = (ptr - region->base) / PAGESIZE;
+  int bit;
+  
+  for (bit = first; bit < first + n; bit++)
+    {
+      region->free_map[bit / BITS] |= 1UL << (bit % BITS);
+    }
+  if (first / BITS < region->map_low)
+    {
+      region->map_low = first / BITS;
+    }
+}
+
+void
+trimTail(kma_region_t* region)
+{
+  unsigned long* map = region->free_map;
+  int top = (region->frontier - region->base) / PAGESIZE;
+  void* keep;
+  
+  // pull the frontier down over the free pages at the top
+  while (top > 0)
+    {
+      if (top % BITS == 0 && map[top / BITS - 1] == ~0UL)
+	{
+	  map[top / BITS - 1] = 0;
+	  top -= BITS;
+	}
+      else if (map[(top - 1) / BITS] & (1UL << ((top - 1) % BITS)))
+	{
+	  map[(top - 1) / BITS] &= ~(1UL << ((top - 1) % BITS));
+	  top--;
+	}
+      else
+	{
+	  break;
+	}
+    }
+  region->frontier = region->base + (long) top * PAGESIZE;
+  
+  // and give the OS back what lies above the frontier, keeping one
+  // spare commit chunk so a region that hovers does not thrash
+  keep = region->base
+    + ((region->frontier - region->base + COMMITSIZE - 1) / COMMITSIZE + 1)
+    * COMMITSIZE;
+  if (region->committed > keep)
+    {
+      madvise(keep, region->committed - keep, MADV_DONTNEED);
+      mprotect(keep, region->committed - keep, PROT_NONE);
+      region->committed = keep;
+    }
+  
+  // the freed pages below keep that the frontier came down over are
+  // still dirty; those above it are zero again
+  if (region->clean > keep)
+    {
+      region->clean = keep;
+    }
+}
+
+void*
+mapAligned(long length, long align, int prot, int flags)
+{
+  void* addr;
+  void* base;
+  long head, tail;
+  
+  // over-map so the mapping can be aligned (at least to PAGESIZE,
+  // which keeps BASEADDR() working for every page handed out)
+  addr = mmap(NULL, length + align, prot,
+	      MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  if (addr == MAP_FAILED)
+    {
+      return NULL;
+    }
+  
+  base = (void*) (((long) addr + align - 1) & ~(align - 1));
+  head = base - addr;
+  tail = align - head;
+  if (head > 0)
+    {
+      munmap(addr, head);
+    }
+  if (tail > 0)
+    {
+      munmap(base + length, tail);
+    }
+  
+  return base;
+}
+
+kma_region_t*
+reserveRegion()
+{
+  kma_region_t* region;
+  void* base;
+  
+  if (num_regions == MAXREGIONS)
+    {
+      error("error: all pages already allocated", "");
+    }
+  
+  base = mapRegion();
+  
+  region = &regions[num_regions];
+  region->base = base;
+  region->frames = (kma_page_t*)
+    mapAligned(REGIONPAGES * sizeof(kma_page_t), PAGESIZE,
+	       PROT_READ | PROT_WRITE, MAP_NORESERVE);
+  if (region->frames == NULL)
+    {
+      error("unable to map the frame table of a region", "mmap");
+    }
+#ifdef KMA_PAGEBITMAP
+  region->free_map = (unsigned long*)
+    mapAligned(REGIONPAGES / 8, PAGESIZE, PROT_READ | PROT_WRITE, 0);
+  if (region->free_map == NULL)
+    {
+      error("unable to map the free page bitmap of a region", "mmap");
+    }
+#endif
+  region->frontier = base;
+  region->clean = base;
+  region->committed = base;
+  region->next_free_page = NULL;
+  region->free_runs = NULL;
+  region->map_low = 0;
+  region->num_in_use = 0;
+  region->idle = 0;
+  
+  // publish the region to lookups that do not take the pool lock
+  __atomic_store_n(&num_regions, num_regions + 1, __ATOMIC_RELEASE);
+  
+  return region;
+}
+
+void*
+mapRegion()
+{
+  void* base;
+  
+  if (hugePages())
+    {
+      // explicit huge pages need a hugetlbfs pool large enough to
+      // reserve the whole region; the kernel aligns the mapping
+      base = mmap(NULL, REGIONSIZE, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (base != MAP_FAILED)
+	{
+	  return base;
+	}
+      
+      // otherwise ask for transparent huge pages on an aligned region
+      base = mapAligned(REGIONSIZE, HUGESIZE, PROT_NONE, MAP_NORESERVE);
+      if (base != NULL)
+	{
+	  madvise(base, REGIONSIZE, MADV_HUGEPAGE);
+	}
+    }
+  else
+    {
+      base = mapAligned(REGIONSIZE, PAGESIZE, PROT_NONE, MAP_NORESERVE);
+    }
+  
+  if (base == NULL)
+    {
+      error("unable to reserve a region for the page pool", "mmap");
+    }
+  
+  return base;
+}
+
+int
+hugePages()
+{
+  char* env;
+  
+  if (huge_pages < 0)
+    {
+      env = getenv("KMA_HUGEPAGES");
+#ifdef KMA_HUGEPAGES
+      huge_pages = (env == NULL || atoi(env) != 0);
+#else
+      huge_pages = (env != NULL && atoi(env) != 0);
+#endif
+    }
+  
+  return huge_pages;
+}
+
+int
+retaining()
+{
+  char* env;
+  
+  if (decay_ops < 0)
+    {
+      env = getenv("KMA_DECAY_OPS");
+      decay_ops = (env != NULL) ? atoi(env) : DECAYOPS;
+    }
+  if (decay_ms < 0)
+    {
+      env = getenv("KMA_DECAY_MS");
+      decay_ms = (env != NULL) ? atoi(env) : DECAYMS;
+    }
+  
+  return decay_ops > 0 || decay_ms > 0;
+}
+
+kma_retained_t*
+retainGroup(void* owner)
+{
+  kma_retained_t* res = NULL;
+  int i;
+  
+  if (!retaining())
+    {
+      return NULL;
+    }
+  
+  for (i = 0; i < MAXOWNERS; i++)
+    {
+      if (retained[i].count > 0 && retained[i].owner == owner)
+	{
+	  res = &retained[i];
+	  break;
+	}
+      if (retained[i].count == 0 && res == NULL)
+	{
+	  res = &retained[i];
+	}
+    }
+  
+  if (res != NULL && res->count == 0)
+    {
+      res->owner = owner;
+      res->head = -1;
+      __atomic_add_fetch(&num_pending, 1, __ATOMIC_RELAXED);
+    }
+  
+  // the whole group decays from its last retain
+  if (res != NULL)
+    {
+      res->ops = __atomic_load_n(&decay_clock, __ATOMIC_RELAXED);
+      res->ms = clockMs();
+    }
+  
+  return res;
+}
+
+void
+purgeGroup(kma_retained_t* group)
+{
+  int n = group->count;
+  
+  while (group->count > 0)
+    {
+      int page = group->head;
+      
+      group->head = frameAt(page)->depot_next;
+      group->count--;
+      freePages(pageAddr(page), 1);
+    }
+  
+  __atomic_sub_fetch(&pool_stats.num_retained, n, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&num_pending, 1, __ATOMIC_RELAXED);
+  pool_stats.num_purged += n;
+}
+
+void
+decayTick()
+{
+  // every thread advances the shared clock DECAYTICK calls at a time,
+  // and only looks for decayed memory when there is any kept
+  if (++my_ops < DECAYTICK)
+    {
+      return;
+    }
+  my_ops = 0;
+  __atomic_add_fetch(&decay_clock, DECAYTICK, __ATOMIC_RELAXED);
+  
+  if (__atomic_load_n(&num_pending, __ATOMIC_RELAXED) > 0)
+    {
+      pthread_mutex_lock(&pool_lock);
+      decayPool();
+      pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+void
+decayPool()
+{
+  int i;
+  
+  for (i = 0; i < MAXOWNERS; i++)
+    {
+      if (retained[i].count > 0 && decayed(retained[i].ops, retained[i].ms))
+	{
+	  purgeGroup(&retained[i]);
+	}
+    }
+  
+  // purged groups may have left regions idle, so these go second
+  for (i = 0; i < num_regions; i++)
+    {
+      kma_region_t* region = &regions[i];
+      
+      if (region->idle && decayed(region->idle_ops, region->idle_ms))
+	{
+	  region->idle = 0;
+	  __atomic_sub_fetch(&num_pending, 1, __ATOMIC_RELAXED);
+	  releaseRegion(region);
+	}
+    }
+}
+
+int
+decayed(unsigned long ops, long ms)
+{
+  if (!retaining())
+    {
+      return 1;
+    }
+  
+  return (decay_ops > 0
+	  && __atomic_load_n(&decay_clock, __ATOMIC_RELAXED) - ops >= decay_ops)
+    || (decay_ms > 0 && clockMs() - ms >= decay_ms);
+}
+
+long
+clockMs()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+kma_region_t*
+findRegion(void* ptr)
+{
+  int n = __atomic_load_n(&num_regions, __ATOMIC_ACQUIRE);
+  int i;
+  
+  for (i = 0; i < n; i++)
+    {
+      if (ptr >= regions[i].base && ptr < regions[i].base + REGIONSIZE)
+	{
+	  return &regions[i];
+	}
+    }
+  
+  return NULL;
+}
+
+void
+commitPages(kma_region_t* region)
+{
+  void* chunk = region->committed;
+  
+  assert(chunk + COMMITSIZE <= region->base + REGIONSIZE);
+  
+  // only the protection changes here; the OS faults each page in when
+  // it is first written, so committing does not touch the memory
+  if (mprotect(chunk, COMMITSIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+      error("unable to commit pages of the page pool", "mprotect");
+    }
+  region->committed = chunk + COMMITSIZE;
+}
+
+void
+releaseRegion(kma_region_t* region)
+{
+  long length = region->committed - region->base;
+  
+  assert(region->num_in_use == 0);
+  
+  // hand the physical pages back to the OS but keep the address range
+  // reserved, so the region can be committed again later
+  if (length > 0)
+    {
+      madvise(region->base, length, MADV_DONTNEED);
+      mprotect(region->base, length, PROT_NONE);
+    }
+  
+  region->frontier = region->base;
+  region->clean = region->base;
+  region->committed = region->base;
+  region->next_free_page = NULL;
+  region->free_runs = NULL;
+#ifdef KMA_PAGEBITMAP
+  memset(region->free_map, 0, REGIONPAGES / 8);
+  region->map_low = 0;
+#endif
+  
+  pool_stats.num_regions_released++;
 }
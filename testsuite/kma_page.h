@@ -64,7 +64,16 @@
 
 #define PAGESIZE 8192
 
-#define MAXPAGES 4096
+// the page pool is a set of reserved virtual regions; each region is
+// committed COMMITPAGES pages at a time as the pool grows
+#define REGIONPAGES 32768
+#define MAXREGIONS 64
+#define COMMITPAGES 256
+
+#define MAXPAGES (REGIONPAGES * MAXREGIONS)
+
+// runs of at least MMAPPAGES pages are mapped from the OS directly
+#define MMAPPAGES 16
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -76,11 +85,27 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
-typedef struct
+/* one descriptor per page (or run of pages), kept in a frame table
+ * outside the pages themselves so the whole page is available to the
+ * allocator */
+typedef struct kma_page
 {
   int id;
   void* ptr;
   int size;
+  // the fields below are free for the allocator holding the page
+  void* owner;
+  int sclass;
+  int inuse;
+  int nfree;
+  void* freelist;
+  struct kma_page* prev;
+  struct kma_page* next;
+  // set by the page allocator when the page (or run) is handed out
+  // holding nothing but zeros
+  int zeroed;
+  // used by the page allocator while the page is free
+  int depot_next;
 } kma_page_t;
 
 typedef struct
@@ -89,6 +114,15 @@ typedef struct
   int num_freed;
   int num_in_use;
   int page_size;
+  // retention: pages set aside by allocators right now, retained pages
+  // handed back to their owner and retained pages that decayed into the
+  // pool; empty regions reused before they decayed and empty regions
+  // returned to the OS
+  int num_retained;
+  int num_reclaimed;
+  int num_purged;
+  int num_regions_revived;
+  int num_regions_released;
 } kma_page_stat_t;
 
 /************Global Variables*********************************************/
@@ -113,6 +147,103 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a run of contiguous memory pages; the size of
+ *             the returned structure covers the whole run
+ *    Input: the number of pages
+ *    Output: the allocated run of memory pages
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int);
+
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run of memory pages obtained from get_pages()
+ *    Input: the pointer to the memory page structure
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
+/***********************************************************************
+ *  Title: Allocates zeroed memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Like get_pages(), but the pages are filled with zeros.
+ *             Single pages come from a pool zeroed ahead of time, and
+ *             pages fresh from the OS are not zeroed again.
+ *    Input: the number of pages
+ *    Output: the allocated run of zeroed memory pages
+ ***********************************************************************/
+EXTERN kma_page_t* get_zeroed_pages(int);
+
+/***********************************************************************
+ *  Title: Allocates a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n single memory pages in one call, which is
+ *             cheaper than n calls to get_page()
+ *    Input: an array for the page structures, the number of pages
+ *    Output: the number of pages stored in the array (always n)
+ ***********************************************************************/
+EXTERN int get_pages_bulk(kma_page_t**, int);
+
+/***********************************************************************
+ *  Title: Releases a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases n single pages or runs in one call, which takes
+ *             each lock once instead of once per call to free_pages()
+ *    Input: an array of page structures, the number of them
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages_bulk(kma_page_t**, int);
+
+/***********************************************************************
+ *  Title: Retains memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases n single memory pages the allocator expects to
+ *             need again soon. The pages keep their contents and
+ *             descriptor and stay set aside for their owner until they
+ *             decay (see page_decay()); until then reclaim_page() hands
+ *             them back. They no longer count as in use.
+ *    Input: an array of page structures, the number of pages
+ *    Output: none
+ ***********************************************************************/
+EXTERN void retain_pages(kma_page_t**, int);
+
+/***********************************************************************
+ *  Title: Reclaims a retained memory page
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes back a page retained with the given owner, with
+ *             its contents and descriptor as they were left
+ *    Input: the owner field of the retained page
+ *    Output: the memory page structure, or NULL if none is left
+ ***********************************************************************/
+EXTERN kma_page_t* reclaim_page(void*);
+
+/***********************************************************************
+ *  Title: Sets the retention decay
+ * ---------------------------------------------------------------------
+ *    Purpose: Retained pages go back to the pool, and empty regions
+ *             back to the OS, once ops page allocator calls or ms
+ *             milliseconds have passed since they were set aside,
+ *             whichever comes first. 0 turns a trigger off; both 0
+ *             turns retention off. The defaults can be overridden with
+ *             KMA_DECAY_OPS and KMA_DECAY_MS in the environment.
+ *    Input: the decay in calls, the decay in milliseconds
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_decay(int, int);
+
+/***********************************************************************
+ *  Title: Finds the descriptor of a memory page
+ * ---------------------------------------------------------------------
+ *    Purpose: Finds the descriptor of the page a pointer points into;
+ *             for runs the pointer must lie in the first page
+ *    Input: a pointer into an allocated page
+ *    Output: the memory page structure of that page
+ ***********************************************************************/
+EXTERN kma_page_t* page_of(void*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
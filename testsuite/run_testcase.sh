@@ -142,6 +142,33 @@ for f in ${EC_PROGS}; do
 	echo;
 done
 
+echo "TESTING WITH THE BITMAP PAGE POOL";
+
+for f in ${PROGS}; do
+	echo $f;
+	${CC} ${CFLAGS} -DKMA_PAGEBITMAP -D${f} -o $f.bitmap ${FILES} > /dev/null 2>&1;
+	OK=1
+	for g in ${BITMAP_TRACES}; do
+	    ./$f.bitmap $g > $f.bitmap.$g.out 2>&1
+	    if [[ ` cat $f.bitmap.$g.out | grep -c "Test: PASS"` -eq 0 ]]; then
+            # failed
+            echo "Trace $g failed. Tail of output follows"
+            echo "..."
+            tail $f.bitmap.$g.out
+            OK=0
+            break
+	    else
+            echo "Trace $g: PASSED"
+	    fi
+	done
+	if [[ $OK -eq "1" ]]; then
+	    echo "Algorithm $f (bitmap page pool): PASSED"
+	else
+	    echo "Algorithm $f (bitmap page pool): FAILED"
+	fi
+	echo;
+done
+
 # Malloc
 echo "MALLOC USAGE";
 grep -H malloc *_*.c --exclude kma_rm.c --exclude kma_page.c | grep -v kma_malloc;